@@ -13,7 +13,11 @@ constexpr size_t batch_size = 28;
 constexpr float rate = 1.0f;
 bool paused = true;
 
-void verify_nn_adder(Font font, NN nn, Gym_Rect r) {
+// Every input of the adder is 0 or 1, so the network is tabulated instead of
+// run over every input every frame, see Truth_Table
+constexpr float binary[] = {0, 1};
+
+void verify_nn_adder(Font font, const Truth_Table& table, Gym_Rect r) {
     float s;
     if(r.w < r.h) {
         s = r.w - r.w * 0.05;
@@ -27,19 +31,10 @@ void verify_nn_adder(Font font, NN nn, Gym_Rect r) {
 
     for(size_t x = 0; x < n; ++x) {
         for(size_t y = 0; y < n; ++y) {
-            for(size_t i = 0; i < BITS; ++i) {
-                nn.input()[i] = (x >> i) & 1;
-                nn.input()[i + BITS] = (y >> i) & 1;
-            }
-
-            nn.forward();
-
-            size_t z = 0.0f;
-            for(size_t i = 0; i < BITS; ++i) {
-                size_t bit = nn.output()[i] > 0.5;
-                z = z | (bit << i);
-            }
-            bool overflow = nn.output()[BITS] > 0.5;
+            // Input i is bit i of x, input i + BITS bit i of y
+            uint64_t bits = table.bits[x | (y << BITS)];
+            size_t z = bits & (n - 1);
+            bool overflow = (bits >> BITS) & 1;
             bool correct = z == x + y;
 
             Vector2 position = {r.x + x * cs, r.y + y * cs};
@@ -92,6 +87,7 @@ int main(void) {
 
     NN nn = NN::alloc(NULL, arch);
     nn.rand(-1, 1);
+    Truth_Table table = Truth_Table::alloc(NULL, nn, binary);
 
     size_t WINDOW_FACTOR = 80;
     size_t WINDOW_WIDTH = (16 * WINDOW_FACTOR);
@@ -126,6 +122,7 @@ int main(void) {
             }
         }
 
+        gym_layout_reset(&temp);
         BeginDrawing();
         ClearBackground(GYM_BACKGROUND);
         {
@@ -144,11 +141,12 @@ int main(void) {
             gym_render_nn(nn, gym_layout_slot());
             gym_render_nn_weights_heatmap(nn, gym_layout_slot());
             gym_layout_end();
-            verify_nn_adder(font, nn, gym_layout_slot());
+            table.update(&temp);
+            verify_nn_adder(font, table, gym_layout_slot());
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, nn.cost(t), temp.occupied_bytes());
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu (peak %zu)\n", epoch, max_epoch, rate, nn.cost(t), temp.occupied_bytes(), temp.peak_bytes());
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h * 0.04, 0, WHITE);
         }
         EndDrawing();
@@ -0,0 +1,75 @@
+// Benchmarks a network compiled by nn_codegen.hpp against NN::forward() on the
+// same weights. The build compiles this file twice: as codegen_emit, which
+// writes a random network to the header named on its command line, and as
+// codegen, which includes that header from the build tree and runs the
+// comparison.
+#include "nn_codegen.hpp"
+
+#ifndef CODEGEN_EMIT
+#include "codegen_model.h"
+#endif // CODEGEN_EMIT
+
+size_t arch[] = {16, 32, 32, 4};
+size_t samples = 1024;
+
+#ifdef CODEGEN_EMIT
+int main(int argc, char** argv) {
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <header>\n", argv[0]);
+        return 1;
+    }
+    Region r(64 * 1024 * 1024);
+    NN nn = NN::alloc(&r, arch);
+    nn.rand(-1, 1);
+    if(!Codegen::save(argv[1], nn, "codegen_model")) {
+        fprintf(stderr, "ERROR: could not write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+#else
+int main(void) {
+    Region r(64 * 1024 * 1024);
+
+    // The network behind the generated code, read back from its arrays
+    NN nn = NN::alloc(&r, {codegen_model_arch, CODEGEN_MODEL_ARCH_COUNT});
+    for(size_t l = 0; l < nn.arch_count - 1; ++l) {
+        for(size_t k = 0; k < nn.ws[l].rows; ++k)
+            for(size_t j = 0; j < nn.ws[l].cols; ++j)
+                nn.ws[l].at(k, j) = codegen_model_ws[l][j * nn.ws[l].rows + k];
+        for(size_t j = 0; j < nn.bs[l].cols; ++j)
+            nn.bs[l][j] = codegen_model_bs[l][j];
+    }
+    nn.touch();
+
+    Mat inputs = Mat::alloc(&r, samples, nn.input().cols);
+    inputs.rand(0, 1);
+    Row out = row_alloc(&r, nn.output().cols);
+    float max_error = 0;
+    for(size_t i = 0; i < samples; ++i) {
+        nn.as[0] = Mat::row(inputs, i);
+        nn.forward();
+        codegen_model_forward(nn.as[0].elements, out.elements);
+        for(size_t j = 0; j < out.cols; ++j)
+            max_error = std::max(max_error, fabsf(out[j] - nn.output()[j]));
+    }
+
+    double generic = seconds_per_call([&] {
+        for(size_t i = 0; i < samples; ++i) {
+            nn.as[0] = Mat::row(inputs, i);
+            nn.forward();
+        }
+    }) / samples;
+    double generated = seconds_per_call([&] {
+        for(size_t i = 0; i < samples; ++i)
+            codegen_model_forward(Mat::row(inputs, i).elements, out.elements);
+    }) / samples;
+
+    printf("arch {");
+    for(size_t l = 0; l < nn.arch_count; ++l)
+        printf("%s%zu", l == 0 ? "" : ", ", nn.arch[l]);
+    printf("}, max difference %g\n", max_error);
+    printf("NN::forward %.3f us, generated %.3f us (%.2fx)\n", generic * 1e6, generated * 1e6, generic / generated);
+    return 0;
+}
+#endif // CODEGEN_EMIT
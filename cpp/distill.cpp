@@ -0,0 +1,57 @@
+// Trains a 16-128-128-4 teacher on a synthetic labelling task, distills it
+// into a 16-8-4 student with nn_distill.hpp and prints the Distill_Report on
+// held-out samples. A student of the same arch trained on the labels alone
+// is printed next to it for comparison.
+#include "nn_distill.hpp"
+
+size_t teacher_arch[] = {16, 128, 128, 4};
+size_t student_arch[] = {16, 8, 4};
+size_t train_samples = 512;
+size_t test_samples = 256;
+size_t soft_samples = 2048; // Inputs made up for the teacher to label
+size_t epochs = 200;
+size_t batch_size = 32;
+float rate = 1.0f;
+
+// Output j is set when a fixed signed mix of the inputs is positive
+void label(Dataset d) {
+    for(size_t i = 0; i < d.x.rows; ++i)
+        for(size_t j = 0; j < d.y.cols; ++j) {
+            float s = 0;
+            for(size_t k = 0; k < d.x.cols; ++k)
+                s += (d.x.at(i, k) - 0.5f) * (float)((k * 7 + j * 3) % 5 - 2);
+            d.y.at(i, j) = s > 0;
+        }
+}
+
+int main(void) {
+    srand(69);
+    Region r(256 * 1024 * 1024);
+    Region temp(256 * 1024 * 1024);
+
+    Dataset train = Dataset::alloc(&r, train_samples, teacher_arch[0], teacher_arch[3]);
+    train.x.rand(0, 1);
+    label(train);
+    Dataset test = Dataset::alloc(&r, test_samples, teacher_arch[0], teacher_arch[3]);
+    test.x.rand(0, 1);
+    label(test);
+
+    NN teacher = NN::alloc(&r, teacher_arch);
+    teacher.rand(-0.2f, 0.2f);
+    Distill::train(&temp, teacher, train, epochs, batch_size, rate);
+
+    Dataset soft = Distill::soft_targets(&r, teacher, soft_samples, [](Row x) {
+        for(size_t k = 0; k < x.cols; ++k)
+            x[k] = rand_float();
+    });
+    NN student = NN::alloc(&r, student_arch);
+    student.rand(-1, 1);
+    Distill::train(&temp, student, soft, epochs, batch_size, rate);
+    Distill_Report::make(&temp, teacher, student, test).print();
+
+    NN direct = NN::alloc(&r, student_arch);
+    direct.rand(-1, 1);
+    Distill::train(&temp, direct, train, epochs, batch_size, rate);
+    printf("the same student trained on the labels: cost %f\n", direct.cost(test));
+    return 0;
+}
@@ -7,6 +7,22 @@
 #include <map>
 
 namespace Chrono = std::chrono;
+
+// Mean wall time of f() in seconds, calling it back to back for at least
+// `budget`
+template <typename F>
+double seconds_per_call(F f, Chrono::milliseconds budget = Chrono::milliseconds(200)) {
+    using Clock = Chrono::steady_clock;
+    size_t calls = 0;
+    auto start = Clock::now();
+    Clock::duration elapsed;
+    do {
+        f();
+        calls += 1;
+        elapsed = Clock::now() - start;
+    } while(elapsed < budget);
+    return Chrono::duration<double>(elapsed).count() / calls;
+}
 struct ElapsedTimer {
     using Sl = std::source_location;
 
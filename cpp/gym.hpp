@@ -32,10 +32,13 @@ enum Gym_Layout_Orient {
     GLO_VERT,
 };
 
+// Dynamic arrays below grow with realloc() unless `resource` is set, in which
+// case the storage comes from that memory resource (for example a Region).
 struct Gym_Plot {
     float* items;
     size_t count;
     size_t capacity;
+    std::pmr::memory_resource* resource;
 };
 
 struct Gym_Layout {
@@ -52,6 +55,7 @@ struct Gym_Layout_Stack {
     Gym_Layout* items;
     size_t count;
     size_t capacity;
+    std::pmr::memory_resource* resource;
 };
 
 inline void gym_layout_stack_push(Gym_Layout_Stack* ls, Gym_Layout_Orient orient, Gym_Rect rect, size_t count, float gap);
@@ -66,23 +70,48 @@ static Gym_Layout_Stack default_gym_layout_stack = {0};
 
 Gym_Rect gym_root(void);
 Gym_Rect gym_fit_square(Gym_Rect r);
+// Makes the default layout stack allocate from `resource`, dropping its old
+// storage. Call it every frame when `resource` is a per-frame region that gets
+// reset, otherwise the stack would keep pointing into recycled memory.
+void gym_layout_reset(std::pmr::memory_resource* resource);
 #define gym_layout_begin(orient, rect, count, gap) gym_layout_stack_push(&default_gym_layout_stack, orient, rect, count, gap)
 #define gym_layout_end()                           gym_layout_stack_pop(&default_gym_layout_stack)
 // TODO: allow a single slot to take up several slots
 #define gym_layout_slot() gym_layout_stack_slot(&default_gym_layout_stack)
 
 #define DA_INIT_CAP 256
-#define da_append(da, item)                                                                                   \
-    do {                                                                                                      \
-        if((da)->count >= (da)->capacity) {                                                                   \
-            (da)->capacity = (da)->capacity == 0 ? DA_INIT_CAP : (da)->capacity * 2;                          \
-            (da)->items = (decltype((da)->items))realloc((da)->items, (da)->capacity * sizeof(*(da)->items)); \
-            GYM_ASSERT((da)->items != NULL && "Buy more RAM lol");                                            \
-        }                                                                                                     \
-                                                                                                              \
-        (da)->items[(da)->count++] = (item);                                                                  \
+#define da_append(da, item)                                                                        \
+    do {                                                                                           \
+        if((da)->count >= (da)->capacity) {                                                        \
+            size_t new_capacity = (da)->capacity == 0 ? DA_INIT_CAP : (da)->capacity * 2;          \
+            (da)->items = (decltype((da)->items))da_realloc((da)->resource, (da)->items,           \
+                (da)->capacity * sizeof(*(da)->items), new_capacity * sizeof(*(da)->items),        \
+                alignof(decltype(*(da)->items)));                                                  \
+            (da)->capacity = new_capacity;                                                         \
+            GYM_ASSERT((da)->items != NULL && "Buy more RAM lol");                                 \
+        }                                                                                          \
+                                                                                                   \
+        (da)->items[(da)->count++] = (item);                                                       \
     } while(0)
 
+inline void* da_realloc(std::pmr::memory_resource* resource, void* items, size_t old_size, size_t new_size, size_t align) {
+    if(resource == nullptr) return realloc(items, new_size);
+    // A Region only takes back the block on top of it, so that one is popped
+    // first and the array grows in place. Popping leaves the bytes intact.
+    if(Region* region = dynamic_cast<Region*>(resource); region != nullptr && items != nullptr) {
+        region->deallocate(items, old_size, align);
+        void* result = region->allocate(new_size, align);
+        if(result != items) memmove(result, items, old_size);
+        return result;
+    }
+    void* result = resource->allocate(new_size, align);
+    if(items != nullptr) {
+        memcpy(result, items, old_size);
+        resource->deallocate(items, old_size, align);
+    }
+    return result;
+}
+
 void gym_render_nn(NN nn, Gym_Rect r);
 void gym_render_mat_as_heatmap(Mat m, Gym_Rect r, size_t max_width);
 void gym_render_nn_weights_heatmap(NN nn, Gym_Rect r);
@@ -115,7 +144,7 @@ inline void gym_render_nn(NN nn, Gym_Rect r) {
                     // j-cols of ws
                     float cx2 = nn_x + (l + 1) * layer_hpad + layer_hpad / 2;
                     float cy2 = nn_y + j * layer_vpad2 + layer_vpad2 / 2;
-                    float value = sigmoidf(nn.ws[l][i][j]);
+                    float value = sigmoidf(nn.ws[l].at(i, j));
                     high_color.a = floorf(255.f * value);
                     float thick = r.h * 0.004f;
                     Vector2 start = {cx1, cy1};
@@ -144,7 +173,7 @@ inline void gym_render_mat_as_heatmap(Mat m, Gym_Rect r, size_t max_width) {
 
     for(size_t y = 0; y < m.rows; ++y) {
         for(size_t x = 0; x < m.cols; ++x) {
-            high_color.a = floorf(255.f * sigmoidf(m[y][x]));
+            high_color.a = floorf(255.f * sigmoidf(m.at(y, x)));
             Color color = ColorAlphaBlend(low_color, high_color, WHITE);
             Gym_Rect slot = {
                 r.x + r.w / 2 - full_width / 2 + x * cell_width,
@@ -311,6 +340,12 @@ inline void gym_layout_stack_push(Gym_Layout_Stack* ls, Gym_Layout_Orient orient
     da_append(ls, l);
 }
 
+void gym_layout_reset(std::pmr::memory_resource* resource) {
+    GYM_ASSERT(default_gym_layout_stack.count == 0 && "Layout stack reset in the middle of a frame");
+    default_gym_layout_stack = {};
+    default_gym_layout_stack.resource = resource;
+}
+
 Gym_Rect gym_root(void) {
     Gym_Rect root = {0};
     root.w = GetRenderWidth();
@@ -253,7 +253,16 @@ int main(int argc, char** argv) {
     printf("%s size %dx%d %d bits\n", img1_file_path, img1_width, img1_height, img1_comp * 8);
     printf("%s size %dx%d %d bits\n", img2_file_path, img2_width, img2_height, img2_comp * 8);
 
+    Dot_Tuner::init(&temp, arch, batch_size);
     NN nn = NN::alloc(NULL, arch);
+    // The previews only run forward(), so their activations ping-pong in a
+    // planned arena while sharing the parameters being trained
+    NN preview = nn.inference(NULL);
+    {
+        Region::Scope scope{&temp};
+        Mem_Plan::make(&temp, arch, Mem_Plan::TRAINING).print("backprop");
+        Mem_Plan::make(&temp, arch, Mem_Plan::INFERENCE).print("preview");
+    }
 
     Mat t = Mat::alloc(NULL, img1_width * img1_height + img2_width * img2_height, nn.input().cols + nn.output().cols);
     for(int y = 0; y < img1_height; ++y) {
@@ -334,9 +343,9 @@ int main(int argc, char** argv) {
             plot.count = 0;
         }
         if(IsKeyPressed(KEY_S))
-            render_upscaled_screenshot(nn, "upscaled.png");
+            render_upscaled_screenshot(preview, "upscaled.png");
         if(IsKeyPressed(KEY_X))
-            render_upscaled_video(nn, 5, "upscaled.mp4");
+            render_upscaled_video(preview, 5, "upscaled.mp4");
 
         for(size_t i = 0; i < batches_per_frame && !paused && epoch < max_epoch; ++i) {
             batch.process(&temp, batch_size, nn, t, rate);
@@ -347,18 +356,19 @@ int main(int argc, char** argv) {
             }
         }
 
-        nn.input()[2] = 0.f;
-        gym_nn_image_grayscale(nn, preview_image1.data, preview_image1.width, preview_image1.height, preview_image1.width, 0, 1);
+        preview.input()[2] = 0.f;
+        gym_nn_image_grayscale(preview, preview_image1.data, preview_image1.width, preview_image1.height, preview_image1.width, 0, 1);
         UpdateTexture(preview_texture1, preview_image1.data);
 
-        nn.input()[2] = 1.f;
-        gym_nn_image_grayscale(nn, preview_image2.data, preview_image2.width, preview_image2.height, preview_image2.width, 0, 1);
+        preview.input()[2] = 1.f;
+        gym_nn_image_grayscale(preview, preview_image2.data, preview_image2.width, preview_image2.height, preview_image2.width, 0, 1);
         UpdateTexture(preview_texture2, preview_image2.data);
 
-        nn.input()[2] = scroll;
-        gym_nn_image_grayscale(nn, preview_image3.data, preview_image3.width, preview_image3.height, preview_image3.width, 0, 1);
+        preview.input()[2] = scroll;
+        gym_nn_image_grayscale(preview, preview_image3.data, preview_image3.width, preview_image3.height, preview_image3.width, 0, 1);
         UpdateTexture(preview_texture3, preview_image3.data);
 
+        gym_layout_reset(&temp);
         BeginDrawing();
         ClearBackground(GYM_BACKGROUND);
         {
@@ -396,7 +406,7 @@ int main(int argc, char** argv) {
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, plot.count > 0 ? plot.items[plot.count - 1] : 0, temp.occupied_bytes());
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu (peak %zu)\n", epoch, max_epoch, rate, plot.count > 0 ? plot.items[plot.count - 1] : 0, temp.occupied_bytes(), temp.peak_bytes());
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h * 0.04, 0, WHITE);
             gym_slider(&rate, &rate_dragging, 0, h * 0.08, w, h * 0.02);
         }
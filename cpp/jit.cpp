@@ -0,0 +1,61 @@
+// Compiles random networks with nn_jit.hpp and checks the generated code
+// against NN::forward() on the same inputs, then times a single-sample
+// forward of both. Also checks that a weight change sends forward() back to
+// the interpreter until the network is compiled again.
+#include "nn_jit.hpp"
+
+size_t small_arch[] = {16, 32, 32, 4};
+size_t medium_arch[] = {64, 128, 64, 10};
+size_t wide_arch[] = {784, 256, 10};
+std::span<const size_t> archs[] = {small_arch, medium_arch, wide_arch};
+size_t samples = 256;
+
+int main(void) {
+    Region r(256 * 1024 * 1024);
+
+    for(std::span<const size_t> arch: archs) {
+        Region::Scope scope{&r};
+        NN nn = NN::alloc(&r, arch);
+        nn.rand(-0.5f, 0.5f);
+        Mat inputs = Mat::alloc(&r, samples, arch[0]);
+        inputs.rand(0, 1);
+        Row expected = row_alloc(&r, arch.back());
+
+        Jit_NN jit = Jit_NN::compile(nn);
+        printf("arch {");
+        for(size_t l = 0; l < arch.size(); ++l)
+            printf("%s%zu", l == 0 ? "" : ", ", arch[l]);
+        printf("}: %s\n", jit.compiled() ? "compiled" : "not compiled, interpreting");
+
+        float max_error = 0;
+        for(size_t i = 0; i < samples; ++i) {
+            nn.as[0] = Mat::row(inputs, i);
+            nn.forward();
+            Mat::copy(expected.as_mat(), nn.output().as_mat());
+            jit.forward();
+            for(size_t j = 0; j < expected.cols; ++j)
+                max_error = std::max(max_error, fabsf(nn.output()[j] - expected[j]));
+        }
+
+        double interpreted = seconds_per_call([&] {
+            for(size_t i = 0; i < samples; ++i) {
+                nn.as[0] = Mat::row(inputs, i);
+                nn.forward();
+            }
+        }) / samples;
+        double jitted = seconds_per_call([&] {
+            for(size_t i = 0; i < samples; ++i) {
+                jit.nn.as[0] = Mat::row(inputs, i);
+                jit.forward();
+            }
+        }) / samples;
+        printf("    max difference %g, NN::forward %.3f us, jit %.3f us (%.2fx)\n",
+            max_error, interpreted * 1e6, jitted * 1e6, interpreted / jitted);
+
+        nn.ws[0].at(0, 0) += 1;
+        nn.touch();
+        printf("    after a weight change: %s\n", jit.compiled() ? "still compiled (stale)" : "interpreting");
+        jit.release();
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+// Shows the rank vs error vs latency tradeoff of replacing the weights of a
+// trained network with Low_Rank factors, layer by layer: the error of the
+// factors, the cost of the network with only that layer factored and the
+// time of the layer product. Then factors every layer at the smallest rank
+// that costs little enough and runs faster than dense, and fine-tunes the
+// factors.
+#include "nn.hpp"
+
+size_t arch[] = {32, 256, 256, 8};
+// A smaller random network generates the training data, so the wide layers
+// have far fewer directions to learn than they have neurons
+size_t source_arch[] = {32, 12, 8};
+size_t samples = 512;
+size_t batch_size = 64;
+size_t train_epochs = 100;
+size_t tune_epochs = 10;
+float rate = 1.0f;
+// A step moves u * v by both the change of u and of v, so the factors are
+// fine-tuned at a smaller rate
+float tune_rate = 0.1f;
+float slack = 0.25f; // Largest relative increase of the cost accepted before fine-tuning
+
+size_t ranks[] = {4, 8, 16, 32, 64, 128};
+
+void train(Region* temp, NN nn, Dataset t, size_t epochs, float rate) {
+    Batch batch{};
+    for(size_t epoch = 0; epoch < epochs; ++epoch) {
+        do {
+            batch.process(temp, batch_size, nn, t, rate);
+        } while(!batch.finished);
+    }
+}
+
+int main(void) {
+    Region r(256 * 1024 * 1024);
+    Region temp(256 * 1024 * 1024);
+
+    NN source = NN::alloc(&r, source_arch);
+    source.rand(-2, 2);
+    Dataset t = Dataset::alloc(&r, samples, arch[0], arch[3]);
+    t.x.rand(0, 1);
+    for(size_t i = 0; i < samples; ++i) {
+        Mat::copy(source.input().as_mat(), Mat::row(t.x, i).as_mat());
+        source.forward();
+        Mat::copy(Mat::row(t.y, i).as_mat(), source.output().as_mat());
+    }
+
+    NN nn = NN::alloc(&r, arch);
+    nn.rand(-0.1f, 0.1f);
+    train(&temp, nn, t, train_epochs, rate);
+    float dense_cost = nn.cost(t);
+    printf("dense cost %f\n\n", dense_cost);
+
+    size_t chosen[std::size(arch) - 1] = {};
+    for(size_t l = 0; l < std::size(arch) - 1; ++l) {
+        Region::Scope scope{&r};
+        Mat w = nn.ws[l];
+        size_t most = std::min(w.rows, w.cols);
+        size_t top = 0;
+        for(size_t k: ranks)
+            if(k < most) top = k;
+        if(top == 0) {
+            printf("layer %zu: %zu x %zu is too thin to factor\n\n", l, w.rows, w.cols);
+            continue;
+        }
+
+        // Factor once at the largest rank, smaller ranks are its prefixes
+        Low_Rank f = Low_Rank::alloc(&r, w.rows, w.cols, top);
+        f.factor(&r, w, 16);
+        Mat saved = Mat::alloc(&r, w.rows, w.cols, w.layout);
+        Mat::copy(saved, w);
+        Mat a = Mat::alloc(&r, 1, w.rows);
+        a.rand(0, 1);
+        Mat dst = Mat::alloc(&r, 1, w.cols);
+        double dense_time = seconds_per_call([&] { Mat::dot(dst, a, w); }, Chrono::milliseconds(100));
+
+        printf("layer %zu: %zu x %zu, dense %.2f us\n", l, w.rows, w.cols, dense_time * 1e6);
+        printf("    rank   error       cost   factored us   speedup\n");
+        for(size_t k: ranks) {
+            if(k > top) break;
+            Low_Rank p = f.prefix(k);
+            float error = p.error(saved);
+            p.expand(w);
+            nn.touch();
+            float cost = nn.cost(t);
+            Mat::copy(w, saved);
+            nn.touch();
+            double time = seconds_per_call([&] { Low_Rank::dot(dst, a, p); }, Chrono::milliseconds(100));
+            if(chosen[l] == 0 && cost <= dense_cost * (1 + slack) && time < dense_time) chosen[l] = k;
+            printf("    %4zu   %5.3f   %8.6f   %11.2f   %6.2fx\n", k, error, cost, time * 1e6, dense_time / time);
+        }
+        if(chosen[l] > 0)
+            printf("    rank %zu is within %.0f%% of the dense cost and faster\n\n", chosen[l], slack * 100);
+        else
+            printf("    stays dense\n\n");
+    }
+
+    for(size_t l = 0; l < std::size(arch) - 1; ++l)
+        if(chosen[l] > 0) printf("layer %zu factored at rank %zu, error %f\n", l, chosen[l], nn.factorize(&r, l, chosen[l]));
+    printf("factored cost %f\n", nn.cost(t));
+    train(&temp, nn, t, tune_epochs, tune_rate);
+    printf("fine-tuned cost %f\n", nn.cost(t));
+
+    return 0;
+}
@@ -4,15 +4,29 @@
 
 #include "elapsed_timer.hpp"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <cmath>
 #include <cstdbool>
 #include <cstddef>
 #include <cstdint>
+#include <concepts>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
+#include <functional>
 #include <memory_resource>
+#include <mutex>
+#include <new>
 #include <random>
 #include <ranges>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
 // #define NN_BACKPROP_TRADITIONAL
 
@@ -24,11 +38,21 @@
 #define NN_RELU_PARAM 0.01f
 #endif // NN_RELU_PARAM
 
+// Storage layout of the weight matrices allocated by NN::alloc
+#ifndef NN_WEIGHTS_LAYOUT
+#define NN_WEIGHTS_LAYOUT Mat::ROW_MAJOR
+#endif // NN_WEIGHTS_LAYOUT
+
 #ifndef NN_MALLOC
 #include <cstdlib>
 #define NN_MALLOC malloc
 #endif // NN_MALLOC
 
+#ifndef NN_FREE
+#include <cstdlib>
+#define NN_FREE free
+#endif // NN_FREE
+
 #ifndef NN_ASSERT
 #include <cassert>
 #define NN_ASSERT assert
@@ -87,35 +111,102 @@ inline constexpr Act ACT_TANH{
 
 float rand_float(void);
 
-class Region {
+#ifndef NN_REGION_MAX_RUNS
+#define NN_REGION_MAX_RUNS 64
+#endif // NN_REGION_MAX_RUNS
+
+// Region is also a std::pmr::memory_resource, so std::pmr containers can take
+// their storage from an arena. deallocate() only gives memory back when it is
+// the most recent allocation; everything else is released by rewind()/reset().
+class Region : public std::pmr::memory_resource {
+public:
+    // What the allocated memory is used for. Only affects the accounting.
+    enum Tag {
+        UNTAGGED,
+        WEIGHTS,
+        GRADIENTS,
+        ACTIVATIONS,
+        DATASET,
+        SCRATCH,
+        TAG_COUNT,
+    };
+
+private:
     size_t capacity;
     size_t size;
     uintptr_t* words;
+    // Shared regions bump `size` with an atomic fetch-add so several worker
+    // threads may allocate from them concurrently
+    bool shared;
+
+    // Accounting, all in words. Allocations form a stack, so the tags form
+    // contiguous runs of words and rewinding only has to pop the runs above
+    // the new top. Shared regions only track the peak.
+    size_t peak;
+    Tag tag;
+    struct Run {
+        size_t begin;
+        Tag tag;
+    } runs[NN_REGION_MAX_RUNS];
+    size_t runs_count;
+    size_t tag_live[TAG_COUNT];
+    size_t tag_peak[TAG_COUNT];
+
+    void account(size_t begin, size_t size_words) {
+        // Once out of runs, keep charging the last one
+        if(runs_count == 0 || (runs[runs_count - 1].tag != tag && runs_count < NN_REGION_MAX_RUNS))
+            runs[runs_count++] = {begin, tag};
+        Tag t = runs[runs_count - 1].tag;
+        tag_live[t] += size_words;
+        if(tag_peak[t] < tag_live[t]) tag_peak[t] = tag_live[t];
+        if(peak < begin + size_words) peak = begin + size_words;
+    }
 
 public:
-    Region(size_t capacity_bytes) {
+    Region(size_t capacity_bytes, bool shared = false)
+        : size{0}, shared{shared}, peak{0}, tag{UNTAGGED}, runs{}, runs_count{0}, tag_live{}, tag_peak{} {
         size_t word_size = sizeof(*words);
         size_t capacity_words = (capacity_bytes + word_size - 1) / word_size;
         words = (decltype(words))NN_MALLOC(capacity_words * word_size);
         NN_ASSERT(words != nullptr);
         capacity = capacity_words;
     }
+    Region(const Region&) = delete;
+    Region& operator=(const Region&) = delete;
+    ~Region() { NN_FREE(words); }
 
     static void* alloc(Region* r, size_t size_bytes) {
         if(r == nullptr) return NN_MALLOC(size_bytes);
         size_t word_size = sizeof(*r->words);
         size_t size_words = (size_bytes + word_size - 1) / word_size;
 
-        NN_ASSERT(r->size + size_words <= r->capacity);
-        if(r->size + size_words > r->capacity) return nullptr;
-        void* result = &r->words[r->size];
-        r->size += size_words;
-        return result;
+        size_t begin = r->size;
+        if(r->shared) {
+            begin = std::atomic_ref{r->size}.fetch_add(size_words, std::memory_order_relaxed);
+            std::atomic_ref peak{r->peak};
+            size_t seen = peak.load(std::memory_order_relaxed);
+            while(seen < begin + size_words && !peak.compare_exchange_weak(seen, begin + size_words, std::memory_order_relaxed)) { }
+        }
+
+        if(begin + size_words > r->capacity) {
+            fprintf(stderr, "ERROR: Region overflow: could not allocate %zu bytes\n", size_bytes);
+            r->report(stderr, "overflowed region");
+            NN_ASSERT(0 && "Region overflow");
+            return nullptr;
+        }
+
+        if(!r->shared) {
+            r->size += size_words;
+            r->account(begin, size_words);
+        }
+        return &r->words[begin];
     }
 
+    // reset()/rewind() on a shared region must only happen at a barrier, when
+    // no other thread is allocating from it
     void reset() {
         NN_ASSERT((this) != nullptr);
-        size = 0;
+        rewind(0);
     }
     size_t occupied_bytes() const {
         NN_ASSERT((this) != nullptr);
@@ -127,8 +218,202 @@ public:
     }
     void rewind(size_t s) {
         NN_ASSERT((this) != nullptr);
+        NN_ASSERT(s <= size);
+        size_t end = size;
+        while(runs_count > 0) {
+            Run& run = runs[runs_count - 1];
+            if(run.begin < s) {
+                tag_live[run.tag] -= end - s;
+                break;
+            }
+            tag_live[run.tag] -= end - run.begin;
+            end = run.begin;
+            runs_count -= 1;
+        }
         size = s;
     }
+
+    // High-water mark since construction or the last reset_peak()
+    size_t peak_bytes() const { return peak * sizeof(*words); }
+    size_t tag_bytes(Tag t) const { return tag_live[t] * sizeof(*words); }
+    size_t tag_peak_bytes(Tag t) const { return tag_peak[t] * sizeof(*words); }
+    size_t capacity_bytes() const { return capacity * sizeof(*words); }
+    void reset_peak() {
+        peak = size;
+        for(size_t t = 0; t < TAG_COUNT; ++t)
+            tag_peak[t] = tag_live[t];
+    }
+
+    static const char* tag_name(Tag t) {
+        switch(t) {
+        case UNTAGGED: return "untagged";
+        case WEIGHTS: return "weights";
+        case GRADIENTS: return "gradients";
+        case ACTIVATIONS: return "activations";
+        case DATASET: return "dataset";
+        case SCRATCH: return "scratch";
+        default: NN_ASSERT(0 && "unreachable"); return "";
+        }
+    }
+
+    void report(FILE* stream, const char* name) const {
+        fprintf(stream, "%s: %zu/%zu bytes occupied, peak %zu bytes\n", name, occupied_bytes(), capacity_bytes(), peak_bytes());
+        if(shared) return;
+        for(size_t t = 0; t < TAG_COUNT; ++t) {
+            if(tag_peak[t] == 0) continue;
+            fprintf(stream, "    %-12s %12zu bytes (peak %zu bytes)\n", tag_name((Tag)t), tag_bytes((Tag)t), tag_peak_bytes((Tag)t));
+        }
+    }
+
+    // Rewinds the region back to where it was at construction once the scope
+    // ends. Scopes nest, so every step can release its temporaries without
+    // touching the memory of the enclosing ones. A null region is a no-op.
+    class Scope {
+        Region* r;
+        size_t s;
+
+    public:
+        explicit Scope(Region* r)
+            : r{r}, s{r != nullptr ? r->save() : 0} { }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() {
+            if(r == nullptr) return;
+            NN_ASSERT(r->size >= s && "Region scopes released out of order");
+            r->rewind(s);
+        }
+    };
+
+    // Charges everything allocated from the region during its lifetime to the
+    // given tag, restoring the previous one afterwards. A null region is a no-op.
+    class Tagged {
+        Region* r;
+        Tag saved;
+
+    public:
+        Tagged(Region* r, Tag t)
+            : r{r}, saved{r != nullptr ? r->tag : UNTAGGED} {
+            if(r != nullptr) r->tag = t;
+        }
+        Tagged(const Tagged&) = delete;
+        Tagged& operator=(const Tagged&) = delete;
+        ~Tagged() {
+            if(r != nullptr) r->tag = saved;
+        }
+    };
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        size_t word_size = sizeof(*words);
+        size_t padding = alignment > word_size ? alignment - word_size : 0;
+        uintptr_t p = (uintptr_t)alloc(this, bytes + padding);
+        if(p == 0) throw std::bad_alloc{};
+        return (void*)((p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        size_t word_size = sizeof(*words);
+        size_t size_words = (bytes + word_size - 1) / word_size;
+        // Pop the allocation if it is on top of the region
+        if(!shared && alignment <= word_size && size_words <= size && p == &words[size - size_words])
+            rewind(size - size_words);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+// A set of per-thread scratch regions. Every worker thread claims its own
+// region on the first call to local() and then allocates from it without any
+// synchronization. reset() wipes all of them and hands them back to the pool,
+// it is meant to be called at the batch barrier, after the workers are done
+// with their scratch memory. Threads that start for a batch and exit with it
+// can so share a pool of as many regions as run at once. A thread leaving
+// between barriers gives its region back with release().
+class Region_Pool {
+    struct Slot {
+        std::atomic<std::thread::id> owner;
+        Region region;
+    };
+
+    Slot* slots;
+    size_t count;
+    size_t id; // Changes on reset(), dropping every thread's cached region
+
+    static inline std::atomic<size_t> next_id{1};
+    // The last pool this thread touched
+    static inline thread_local size_t cached_id = 0;
+    static inline thread_local Region* cached = nullptr;
+
+public:
+    Region_Pool(size_t threads, size_t capacity_bytes)
+        : count{threads}, id{next_id++} {
+        NN_ASSERT(threads > 0);
+        slots = (decltype(slots))NN_MALLOC(sizeof(*slots) * count);
+        NN_ASSERT(slots != nullptr);
+        for(size_t i = 0; i < count; ++i)
+            new(&slots[i]) Slot{{}, Region{capacity_bytes}};
+    }
+    Region_Pool(const Region_Pool&) = delete;
+    Region_Pool& operator=(const Region_Pool&) = delete;
+    ~Region_Pool() {
+        for(size_t i = 0; i < count; ++i)
+            slots[i].~Slot();
+        NN_FREE(slots);
+    }
+
+    Region* local() {
+        if(cached_id == id) return cached;
+
+        std::thread::id self = std::this_thread::get_id();
+        Region* found = nullptr;
+        for(size_t i = 0; i < count && found == nullptr; ++i)
+            if(slots[i].owner.load(std::memory_order_acquire) == self)
+                found = &slots[i].region;
+        for(size_t i = 0; i < count && found == nullptr; ++i) {
+            std::thread::id none{};
+            if(slots[i].owner.compare_exchange_strong(none, self, std::memory_order_acq_rel))
+                found = &slots[i].region;
+        }
+        NN_ASSERT(found != nullptr && "More worker threads than regions in the pool");
+
+        cached_id = id;
+        cached = found;
+        return found;
+    }
+
+    Region* at(size_t i) {
+        NN_ASSERT(i < count);
+        return &slots[i].region;
+    }
+    size_t size() const { return count; }
+
+    void reset() {
+        for(size_t i = 0; i < count; ++i) {
+            slots[i].region.reset();
+            slots[i].owner.store(std::thread::id{}, std::memory_order_release);
+        }
+        id = next_id++;
+    }
+
+    // Wipes the calling thread's region and gives it back to the pool
+    void release() {
+        std::thread::id self = std::this_thread::get_id();
+        for(size_t i = 0; i < count; ++i) {
+            if(slots[i].owner.load(std::memory_order_acquire) != self) continue;
+            slots[i].region.reset();
+            slots[i].owner.store(std::thread::id{}, std::memory_order_release);
+        }
+        if(cached_id == id) cached_id = 0;
+    }
+
+    size_t occupied_bytes() const {
+        size_t bytes = 0;
+        for(size_t i = 0; i < count; ++i)
+            bytes += slots[i].region.occupied_bytes();
+        return bytes;
+    }
 };
 
 // capacity is in bytes, but it can allocate more just to keep things
@@ -177,11 +462,209 @@ struct Row : Util<Row> {
         };
     }
     Mat as_mat();
+
+    // Elementwise expressions, see Expr_Base
+    template <typename E>
+    Row& assign(E e);
+    template <typename E>
+    Row& operator+=(E e);
+    template <typename E>
+    Row& operator-=(E e);
+};
+
+#ifndef NN_PANEL
+#define NN_PANEL 16
+#endif // NN_PANEL
+
+// Worker threads for parallel kernels, 0 takes std::thread::hardware_concurrency()
+#ifndef NN_THREADS
+#define NN_THREADS 0
+#endif // NN_THREADS
+
+// Default weight count from which a single-row product is split across
+// threads, below it waking them costs more than it saves. See Dot_Tiles.
+#ifndef NN_GEMV_PARALLEL
+#define NN_GEMV_PARALLEL (1 << 20)
+#endif // NN_GEMV_PARALLEL
+
+// Inputs with at most this fraction of non-zeros take the sparse paths of
+// the single-row kernels and of backprop, which only touch the weight rows
+// of the non-zero inputs. Measured on 784-wide binary inputs, skipping
+// breaks even at ~0.5 density into 14 outputs and ~0.7 into 256.
+#ifndef NN_SPARSE_DENSITY
+#define NN_SPARSE_DENSITY 0.5f
+#endif // NN_SPARSE_DENSITY
+
+inline bool sparse_enough(const float* x, size_t n) {
+    size_t nonzero = 0;
+    for(size_t k = 0; k < n; ++k)
+        nonzero += x[k] != 0;
+    return nonzero <= n * NN_SPARSE_DENSITY;
+}
+
+// Calls f(k) for every x[k] != 0 in increasing k. The indices are gathered
+// a chunk at a time without branching on the values, so the pattern of
+// zeros costs no mispredictions.
+template <typename F>
+void for_nonzero(const float* x, size_t n, F f) {
+    uint32_t nonzero[256];
+    for(size_t begin = 0; begin < n; begin += 256) {
+        size_t end = std::min<size_t>(begin + 256, n);
+        size_t count = 0;
+        for(size_t k = begin; k < end; ++k) {
+            nonzero[count] = k;
+            count += x[k] != 0;
+        }
+        for(size_t i = 0; i < count; ++i)
+            f(nonzero[i]);
+    }
+}
+
+// Worker threads parked between parallel_ranges() calls, so a call costs a
+// wake-up rather than a thread start per range. One job runs at a time: a
+// call made while the pool is busy, from another thread or from inside a
+// job, gets false back and is expected to do the work itself.
+struct Thread_Pool {
+    std::mutex busy;
+    std::mutex m;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::vector<std::thread> workers;
+    std::function<void(size_t)> job;
+    size_t count = 0;      // Parts of the current job, part 0 is the caller's
+    size_t pending = 0;    // Parts still running on the workers
+    size_t generation = 0; // Bumped for every job
+    bool stop = false;
+
+    explicit Thread_Pool(size_t n) {
+        workers.reserve(n);
+        for(size_t t = 1; t <= n; ++t)
+            workers.emplace_back([this, t] { work(t); });
+    }
+
+    ~Thread_Pool() {
+        {
+            std::lock_guard lock{m};
+            stop = true;
+        }
+        wake.notify_all();
+        for(auto& worker: workers)
+            worker.join();
+    }
+
+    // The pool of NN_THREADS threads, counting the caller, started on first use
+    static Thread_Pool& get() {
+        static Thread_Pool pool{(NN_THREADS > 0 ? NN_THREADS : std::max(1u, std::thread::hardware_concurrency())) - 1};
+        return pool;
+    }
+
+    size_t threads() const { return workers.size() + 1; }
+
+    void work(size_t t) {
+        size_t seen = 0;
+        std::unique_lock lock{m};
+        for(;;) {
+            wake.wait(lock, [&] { return stop || generation != seen; });
+            if(stop) return;
+            seen = generation;
+            if(t >= count) continue;
+            lock.unlock();
+            job(t);
+            lock.lock();
+            if(--pending == 0) done.notify_one();
+        }
+    }
+
+    // Runs f(t) for every t in [0, n), f(0) on the calling thread, and
+    // returns once all of them are done
+    bool run(size_t n, std::function<void(size_t)> f) {
+        NN_ASSERT(n <= threads());
+        std::unique_lock guard{busy, std::try_to_lock};
+        if(!guard.owns_lock()) return false;
+        {
+            std::lock_guard lock{m};
+            job = std::move(f);
+            count = n;
+            pending = n - 1;
+            generation += 1;
+        }
+        wake.notify_all();
+        job(0);
+        std::unique_lock lock{m};
+        done.wait(lock, [&] { return pending == 0; });
+        return true;
+    }
+};
+
+// Calls f(begin, end) for ranges covering [0, n), each a multiple of `chunk`
+// long except the last, one range per thread of Thread_Pool. The calling
+// thread takes the first range and returns once all of them are done. It
+// runs all of them itself while the pool is busy.
+template <typename F>
+void parallel_ranges(size_t n, size_t chunk, F f) {
+    Thread_Pool& pool = Thread_Pool::get();
+    size_t threads = pool.threads();
+    size_t chunks = (n + chunk - 1) / chunk;
+    if(threads > chunks) threads = chunks;
+    if(threads <= 1) {
+        f(0, n);
+        return;
+    }
+
+    size_t per_thread = (chunks + threads - 1) / threads * chunk;
+    size_t ranges = (n + per_thread - 1) / per_thread;
+    bool ran = pool.run(ranges, [&](size_t t) {
+        f(t * per_thread, std::min((t + 1) * per_thread, n));
+    });
+    if(!ran) f(0, n);
+}
+
+#ifndef NN_BLOCK
+#define NN_BLOCK 8
+#endif // NN_BLOCK
+
+// Tiling of the multi-row Mat::dot() kernel: the product is walked in
+// k x j blocks of b, `unroll` rows of a at a time. The single-row gemv()
+// walks b in column blocks of gemv_j (0 takes all columns at once) and is
+// split across threads from `parallel` weights on. Kept Panels serve
+// single-row and multi-row products only where pack_single and pack_batch
+// are set. The best values depend on the cache sizes, see Dot_Tuner.
+struct Dot_Tiles {
+    size_t k = 128;
+    size_t j = 256;
+    size_t unroll = 4;
+    size_t gemv_j = 0;
+    size_t parallel = NN_GEMV_PARALLEL;
+    bool pack_single = true;
+    bool pack_batch = true;
 };
+inline Dot_Tiles dot_tiles;
 
+// Offset of element (i, j) in NN_BLOCK x NN_BLOCK tiles laid out row-major,
+// each tile row-major inside. `stride` is the padded column count.
+inline size_t blocked_offset(size_t i, size_t j, size_t stride) {
+    size_t tile = (i / NN_BLOCK) * (stride / NN_BLOCK) + j / NN_BLOCK;
+    return tile * NN_BLOCK * NN_BLOCK + (i % NN_BLOCK) * NN_BLOCK + j % NN_BLOCK;
+}
+
+// Mat is a view over storage in one of three layouts:
+//  - ROW_MAJOR: element (i, j) at elements[i * stride + j]
+//  - COL_MAJOR: element (i, j) at elements[j * stride + i]
+//  - BLOCKED:   NN_BLOCK x NN_BLOCK tiles, see blocked_offset()
+// `stride` is the leading dimension, so row and column ranges of a bigger
+// matrix are Mats too and transposing swaps ROW_MAJOR and COL_MAJOR.
+// operator[] only works for ROW_MAJOR, at() works for every layout.
 struct Mat : Util<Mat> {
+    enum Layout {
+        ROW_MAJOR,
+        COL_MAJOR,
+        BLOCKED,
+    };
+
     size_t rows, cols;
     float* elements;
+    size_t stride;
+    Layout layout;
 
     // Mat(size_t rows, size_t cols)
     //     : rows{rows}, cols{cols} {
@@ -192,22 +675,118 @@ struct Mat : Util<Mat> {
 
     auto size() const noexcept { return rows * cols; }
     auto data() const noexcept { return elements; }
-    auto begin() const noexcept { return elements; }
-    auto end() const noexcept { return elements + size(); }
+    bool contiguous() const noexcept { return layout == ROW_MAJOR && stride == cols; }
+    // Only a contiguous view is the plain range [begin(), end())
+    auto begin() const {
+        NN_ASSERT(contiguous());
+        return elements;
+    }
+    auto end() const {
+        NN_ASSERT(contiguous());
+        return elements + size();
+    }
+
+    auto span() {
+        NN_ASSERT(contiguous());
+        return std::span{elements, size()};
+    }
 
     auto operator[](size_t r) const {
-        return std::span{elements + r * cols, cols};
+        NN_ASSERT(layout == ROW_MAJOR);
+        return std::span{elements + r * stride, cols};
     }
     auto operator[](size_t r) {
-        return std::span{elements + r * cols, cols};
+        NN_ASSERT(layout == ROW_MAJOR);
+        return std::span{elements + r * stride, cols};
+    }
+    float& at(size_t i, size_t j) const {
+        switch(layout) {
+        case ROW_MAJOR: return elements[i * stride + j];
+        case COL_MAJOR: return elements[j * stride + i];
+        case BLOCKED: return elements[blocked_offset(i, j, stride)];
+        }
+        NN_ASSERT(0 && "unreachable");
+        return elements[0];
+    }
+
+    // Element (i, j) of a ROW_MAJOR or COL_MAJOR view is at
+    // elements[i * row_step() + j * col_step()]
+    size_t row_step() const {
+        NN_ASSERT(layout != BLOCKED);
+        return layout == ROW_MAJOR ? stride : 1;
+    }
+    size_t col_step() const {
+        NN_ASSERT(layout != BLOCKED);
+        return layout == ROW_MAJOR ? 1 : stride;
+    }
+
+    // One past the last float the view can reach
+    const float* storage_end() const {
+        if(rows == 0 || cols == 0) return elements;
+        if(layout == BLOCKED) return elements + (rows + NN_BLOCK - 1) / NN_BLOCK * NN_BLOCK * stride;
+        return &at(rows - 1, cols - 1) + 1;
+    }
+
+    // Whether a and b may share elements. Row-major views of the same stride
+    // side by side, like the halves of Dataset::split(), do not.
+    static bool overlap(Mat a, Mat b) {
+        if(a.elements >= b.storage_end() || b.elements >= a.storage_end()) return false;
+        if(a.layout != ROW_MAJOR || b.layout != ROW_MAJOR || a.stride != b.stride) return true;
+        ptrdiff_t s = a.stride;
+        ptrdiff_t c = ((b.elements - a.elements) % s + s) % s; // Column of b[0][0] in a's rows
+        auto hits = [&](ptrdiff_t c) { return c < (ptrdiff_t)a.cols && c + (ptrdiff_t)b.cols > 0; };
+        return hits(c) || hits(c - s);
     }
 
-    static Mat alloc(Region* r, size_t rows, size_t cols) {
+    static Mat alloc(Region* r, size_t rows, size_t cols, Layout layout = ROW_MAJOR) {
+        Mat m = view(nullptr, rows, cols, layout);
+        size_t count = layout == BLOCKED ? (rows + NN_BLOCK - 1) / NN_BLOCK * NN_BLOCK * m.stride : rows * cols;
+        m.elements = (float*)Region::alloc(r, sizeof(*m.elements) * count);
+        NN_ASSERT(m.elements != nullptr);
+        return m;
+    }
+
+    // Wraps `rows * cols` floats stored in `layout`
+    static Mat view(float* elements, size_t rows, size_t cols, Layout layout = ROW_MAJOR) {
         Mat m;
         m.rows = rows;
         m.cols = cols;
-        m.elements = (float*)Region::alloc(r, sizeof(*m.elements) * rows * cols);
-        NN_ASSERT(m.elements != nullptr);
+        m.elements = elements;
+        m.layout = layout;
+        switch(layout) {
+        case ROW_MAJOR: m.stride = cols; break;
+        case COL_MAJOR: m.stride = rows; break;
+        case BLOCKED:
+            // Partial tiles at the edges are padded
+            m.stride = (cols + NN_BLOCK - 1) / NN_BLOCK * NN_BLOCK;
+            break;
+        }
+        return m;
+    }
+
+    // Ranges of BLOCKED matrices have to start at a tile boundary
+    Mat slice_rows(size_t begin, size_t n) const {
+        NN_ASSERT(begin + n <= rows);
+        NN_ASSERT(layout != BLOCKED || begin % NN_BLOCK == 0);
+        Mat m = *this;
+        m.rows = n;
+        if(n > 0) m.elements = &at(begin, 0);
+        return m;
+    }
+    Mat slice_cols(size_t begin, size_t n) const {
+        NN_ASSERT(begin + n <= cols);
+        NN_ASSERT(layout != BLOCKED || begin % NN_BLOCK == 0);
+        Mat m = *this;
+        m.cols = n;
+        if(n > 0) m.elements = &at(0, begin);
+        return m;
+    }
+    Mat transpose() const {
+        NN_ASSERT(layout != BLOCKED && "Blocked matrices can not be transposed in place");
+        Mat m = *this;
+        m.rows = cols;
+        m.cols = rows;
+        m.layout = layout == ROW_MAJOR ? COL_MAJOR : ROW_MAJOR;
         return m;
     }
 
@@ -218,35 +797,41 @@ struct Mat : Util<Mat> {
         };
     }
 
-    static void copy(Mat dst, Mat src) {
-        NN_ASSERT(dst.rows == src.rows);
-        NN_ASSERT(dst.cols == src.cols);
-        for(size_t i = 0; i < dst.rows; ++i)
-            for(size_t j = 0; j < dst.cols; ++j)
-                dst[i][j] = src[i][j];
-    }
-
-    Mat& operator+=(Mat a) {
-        NN_ASSERT(rows == a.rows);
-        NN_ASSERT(cols == a.cols);
+    void fill(float x) {
         for(size_t i = 0; i < rows; ++i)
             for(size_t j = 0; j < cols; ++j)
-                (*this)[i][j] += a[i][j];
-        return *this;
+                at(i, j) = x;
     }
 
-    void act() {
+    void rand(float low, float high) {
         for(size_t i = 0; i < rows; ++i)
             for(size_t j = 0; j < cols; ++j)
-                (*this)[i][j] = NN_ACT.actf((*this)[i][j]);
+                at(i, j) = rand_float() * (high - low) + low;
+    }
+
+    static void copy(Mat dst, Mat src) {
+        NN_ASSERT(dst.rows == src.rows);
+        NN_ASSERT(dst.cols == src.cols);
+        dst.assign(src);
     }
 
+    // Elementwise expressions, see Expr_Base. There is deliberately no
+    // operator= taking an expression: assigning a Mat rebinds the view.
+    template <typename E>
+    Mat& assign(E e);
+    template <typename E>
+    Mat& operator+=(E e);
+    template <typename E>
+    Mat& operator-=(E e);
+
+    void act();
+
     void print(const char* name, size_t padding) {
         printf("%*s%s = [\n", (int)padding, "", name);
         for(size_t i = 0; i < rows; ++i) {
             printf("%*s    ", (int)padding, "");
             for(size_t j = 0; j < cols; ++j)
-                printf("%f ", (*this)[i][j]);
+                printf("%f ", at(i, j));
             printf("\n");
         }
         printf("%*s]\n", (int)padding, "");
@@ -257,8 +842,8 @@ struct Mat : Util<Mat> {
         NN_ASSERT(dst.rows == a.rows);
         NN_ASSERT(dst.cols == b.cols);
 
-        const size_t n = a.cols;
 #if 0
+    const size_t n = a.cols;
     size_t startAt = n % 4;
     auto *dr = dst.begin(), *ar = a.begin();
     while(dr < dst.end()) {
@@ -285,15 +870,178 @@ struct Mat : Util<Mat> {
     }
 
 #else
+        if(dst.layout != ROW_MAJOR || a.layout != ROW_MAJOR || b.layout != ROW_MAJOR) {
+            dot_layouts(dst, a, b);
+            return;
+        }
+
+        if(a.rows == 1) {
+            gemv(dst, a, b);
+            return;
+        }
+
         // ElapsedTimer et{};
-        for(size_t i = 0; i < dst.rows; ++i) {
+        dot_tiled(dst, a, b, dot_tiles);
+#endif
+    }
+
+    // dot() for operands that are not all row-major, summing in the same
+    // order. Row- and column-major views are walked with their steps, a
+    // BLOCKED b one contiguous tile at a time. Only a BLOCKED a or dst goes
+    // element by element through at().
+    static void dot_layouts(Mat dst, Mat a, Mat b) {
+        const size_t n = a.cols;
+        if(dst.layout == BLOCKED || a.layout == BLOCKED) {
+            for(size_t i = 0; i < dst.rows; ++i) {
+                for(size_t j = 0; j < dst.cols; ++j) {
+                    float acc = 0;
+                    for(size_t k = 0; k < n; ++k)
+                        acc += a.at(i, k) * b.at(k, j);
+                    dst.at(i, j) = acc;
+                }
+            }
+            return;
+        }
+
+        const size_t ai = a.row_step(), ak = a.col_step();
+        const size_t di = dst.row_step(), dj = dst.col_step();
+        if(b.layout == BLOCKED) {
+            for(size_t i = 0; i < dst.rows; ++i)
+                for(size_t j = 0; j < dst.cols; ++j)
+                    dst.elements[i * di + j * dj] = 0;
+            for(size_t k0 = 0; k0 < n; k0 += NN_BLOCK) {
+                size_t k1 = std::min<size_t>(k0 + NN_BLOCK, n);
+                for(size_t j0 = 0; j0 < b.cols; j0 += NN_BLOCK) {
+                    size_t j1 = std::min<size_t>(j0 + NN_BLOCK, b.cols);
+                    const float* tile = b.elements + blocked_offset(k0, j0, b.stride);
+                    for(size_t i = 0; i < dst.rows; ++i) {
+                        float* d = dst.elements + i * di;
+                        for(size_t k = k0; k < k1; ++k) {
+                            float x = a.elements[i * ai + k * ak];
+                            const float* t = tile + (k - k0) * NN_BLOCK - j0;
+                            for(size_t j = j0; j < j1; ++j)
+                                d[j * dj] += x * t[j];
+                        }
+                    }
+                }
+            }
+            return;
+        }
+
+        const size_t bk = b.row_step(), bj = b.col_step();
+        if(bj == 1) {
+            // Rows of b are contiguous: scale and accumulate them
+            for(size_t i = 0; i < dst.rows; ++i) {
+                float* d = dst.elements + i * di;
+                for(size_t j = 0; j < dst.cols; ++j)
+                    d[j * dj] = 0;
+                for(size_t k = 0; k < n; ++k) {
+                    float x = a.elements[i * ai + k * ak];
+                    const float* br = b.elements + k * bk;
+                    for(size_t j = 0; j < dst.cols; ++j)
+                        d[j * dj] += x * br[j];
+                }
+            }
+            return;
+        }
+        // Columns of b are contiguous: one dot product per element
+        for(size_t i = 0; i < dst.rows; ++i)
             for(size_t j = 0; j < dst.cols; ++j) {
-                dst[i][j] = 0;
+                const float* ar = a.elements + i * ai;
+                const float* bc = b.elements + j * bj;
+                float acc = 0;
                 for(size_t k = 0; k < n; ++k)
-                    dst[i][j] += a[i][k] * b[k][j];
+                    acc += ar[k * ak] * bc[k];
+                dst.elements[i * di + j * dj] = acc;
+            }
+    }
+
+    // Row-major dot() blocked by `tiles`. Every element still sums its
+    // products in increasing k, so any tiling gives the same result.
+    static void dot_tiled(Mat dst, Mat a, Mat b, Dot_Tiles tiles) {
+        NN_ASSERT(tiles.k > 0 && tiles.j > 0);
+        dst.fill(0);
+        for(size_t k0 = 0; k0 < a.cols; k0 += tiles.k) {
+            size_t k1 = std::min(k0 + tiles.k, a.cols);
+            for(size_t j0 = 0; j0 < b.cols; j0 += tiles.j) {
+                size_t j1 = std::min(j0 + tiles.j, b.cols);
+                size_t i = 0;
+                switch(tiles.unroll) {
+                case 8: for(; i + 8 <= dst.rows; i += 8) dot_rows<8>(dst, a, b, i, k0, k1, j0, j1); break;
+                case 4: for(; i + 4 <= dst.rows; i += 4) dot_rows<4>(dst, a, b, i, k0, k1, j0, j1); break;
+                case 2: for(; i + 2 <= dst.rows; i += 2) dot_rows<2>(dst, a, b, i, k0, k1, j0, j1); break;
+                default: break;
+                }
+                for(; i < dst.rows; ++i)
+                    dot_rows<1>(dst, a, b, i, k0, k1, j0, j1);
             }
         }
-#endif
+    }
+
+    // Accumulates rows [i, i + U) of a times the [k0, k1) x [j0, j1) block of
+    // b, every element of b loaded once for all U rows
+    template <size_t U>
+    static void dot_rows(Mat dst, Mat a, Mat b, size_t i, size_t k0, size_t k1, size_t j0, size_t j1) {
+        float* d[U];
+        for(size_t u = 0; u < U; ++u)
+            d[u] = dst.elements + (i + u) * dst.stride;
+        for(size_t k = k0; k < k1; ++k) {
+            float x[U];
+            for(size_t u = 0; u < U; ++u)
+                x[u] = a.elements[(i + u) * a.stride + k];
+            const float* br = b.elements + k * b.stride;
+            for(size_t j = j0; j < j1; ++j) {
+                float bj = br[j];
+                for(size_t u = 0; u < U; ++u)
+                    d[u][j] += x[u] * bj;
+            }
+        }
+    }
+
+    // dst = a * b for a single row a, the shape of every forward(). b is
+    // streamed in its row-major order, each of its rows scaled by one
+    // element of a and accumulated into dst; wide products are split across
+    // threads by cache-line aligned column ranges. Sums in the same order as
+    // dot() does.
+    static void gemv(Mat dst, Mat a, Mat b) {
+        gemv_tiled(dst, a, b, dot_tiles);
+    }
+
+    // gemv() with the column blocks and threading of `tiles`
+    static void gemv_tiled(Mat dst, Mat a, Mat b, Dot_Tiles tiles) {
+        NN_ASSERT(a.rows == 1 && dst.rows == 1);
+        NN_ASSERT(a.cols == b.rows);
+        NN_ASSERT(dst.cols == b.cols);
+        NN_ASSERT(dst.layout == ROW_MAJOR && a.layout == ROW_MAJOR && b.layout == ROW_MAJOR);
+
+        // Zero inputs add nothing, a sparse a only streams the rows of b it selects
+        bool sparse = sparse_enough(a.elements, a.cols);
+        size_t block = tiles.gemv_j > 0 ? tiles.gemv_j : b.cols;
+        auto columns = [dst, a, b, sparse, block](size_t begin, size_t end) {
+            float* d = dst.elements;
+            for(size_t j0 = begin; j0 < end; j0 += block) {
+                size_t j1 = std::min(j0 + block, end);
+                for(size_t j = j0; j < j1; ++j)
+                    d[j] = 0;
+                auto axpy = [&](size_t k) {
+                    float x = a.elements[k];
+                    const float* br = b.elements + k * b.stride;
+                    for(size_t j = j0; j < j1; ++j)
+                        d[j] += x * br[j];
+                };
+                if(sparse) {
+                    for_nonzero(a.elements, a.cols, axpy);
+                } else {
+                    for(size_t k = 0; k < b.rows; ++k)
+                        axpy(k);
+                }
+            }
+        };
+
+        if(b.rows * b.cols < tiles.parallel)
+            columns(0, b.cols);
+        else
+            parallel_ranges(b.cols, 64 / sizeof(float), columns);
     }
 
     void shuffle_rows() {
@@ -302,92 +1050,1495 @@ struct Mat : Util<Mat> {
             size_t j = i + ::rand() % (rows - i);
             if(i != j)
                 for(size_t k = 0; k < cols; ++k)
-                    std::swap((*this)[i][k], (*this)[j][k]);
+                    std::swap(at(i, k), at(j, k));
         }
     }
 };
 
 inline Mat Row::as_mat() {
-    return Mat{
-        .rows = 1,
-        .cols = cols,
-        .elements = elements,
-    };
+    return Mat::view(elements, 1, cols);
 }
 
-// #define ROW_AT(row, col) (row).elements[col]
-// void Mat::dot(Mat dst, Mat a, Mat b);
-// Mat row_as_mat(Row row);
-#define row_alloc(r, cols) Mat::row(Mat::alloc(r, 1, cols), 0)
-Row row_slice(Row row, size_t i, size_t cols);
-// #define row_rand(row, low, high)      mat_rand(row_as_mat(row), low, high)
-// #define row_fill(row, x)              row_as_mat(row).fill(x);
-#define row_print(row, name, padding) row.as_mat().print(name, padding)
-#define row_copy(dst, src)            Mat::copy(dst.as_mat(), src.as_mat())
-
-// #define m[i][j] (m).elements[(i) * (m).cols + (j)]
-// Mat mat_alloc(Region* r, size_t rows, size_t cols);
-// void mat_fill(Mat m, float x);
-// void mat_rand(Mat m, float low, float high);
-// Row mat_row(Mat m, size_t row);
-// void mat_copy(Mat dst, Mat src);
-// void Mat::dot(Mat dst, Mat a, Mat b);
-// void mat_sum(Mat dst, Mat a);
-// void mat_act(Mat m);
-// void mat_print(Mat m, const char* name, size_t padding);
-// void mat_shuffle_rows(Mat m);
-#define MAT_PRINT(m) m.print(#m, 0)
-
-struct NN {
-    const size_t* arch;
-    size_t arch_count;
-    Mat* ws; // The amount of activations is arch_count-1
-    Row* bs; // The amount of activations is arch_count-1
+// The right-hand side of a matrix product packed once into column panels of
+// NN_PANEL, so dot() streams it contiguously instead of walking its columns.
+// Panel p holds columns [p * NN_PANEL, (p + 1) * NN_PANEL) row after row,
+// the last one is padded with zeros.
+struct Panels {
+    size_t rows;
+    size_t cols;
+    float* elements;
 
-    // TODO: maybe remove these? It would be better to allocate them in a
-    // temporary region during the actual forwarding
-    Row* as;
+    size_t count() const { return (cols + NN_PANEL - 1) / NN_PANEL; }
 
-    static NN alloc(Region* r, std::span<const size_t> arch) {
-        NN_ASSERT(arch.size() > 0);
+    static Panels alloc(Region* r, size_t rows, size_t cols) {
+        Panels p;
+        p.rows = rows;
+        p.cols = cols;
+        p.elements = (float*)Region::alloc(r, sizeof(*p.elements) * rows * p.count() * NN_PANEL);
+        NN_ASSERT(p.elements != nullptr);
+        return p;
+    }
 
-        NN nn;
-        nn.arch = arch.data();
-        nn.arch_count = arch.size();
+    void pack(Mat b) {
+        NN_ASSERT(b.rows == rows);
+        NN_ASSERT(b.cols == cols);
+        for(size_t p = 0; p < count(); ++p) {
+            float* panel = elements + p * rows * NN_PANEL;
+            for(size_t k = 0; k < rows; ++k)
+                for(size_t jj = 0; jj < NN_PANEL; ++jj) {
+                    size_t j = p * NN_PANEL + jj;
+                    panel[k * NN_PANEL + jj] = j < cols ? b.at(k, j) : 0;
+                }
+        }
+    }
 
-        nn.ws = (decltype(nn.ws))Region::alloc(r, sizeof(*nn.ws) * (nn.arch_count - 1));
-        NN_ASSERT(nn.ws != nullptr);
-        nn.bs = (decltype(nn.bs))Region::alloc(r, sizeof(*nn.bs) * (nn.arch_count - 1));
-        NN_ASSERT(nn.bs != nullptr);
-        nn.as = (decltype(nn.as))Region::alloc(r, sizeof(*nn.as) * nn.arch_count);
-        NN_ASSERT(nn.as != nullptr);
+    // Sums in the same order as Mat::dot(), so both give identical results
+    static void dot(Mat dst, Mat a, Panels b) {
+        NN_ASSERT(a.cols == b.rows);
+        NN_ASSERT(dst.rows == a.rows);
+        NN_ASSERT(dst.cols == b.cols);
+        NN_ASSERT(dst.layout == Mat::ROW_MAJOR && a.layout == Mat::ROW_MAJOR);
 
-        nn.as[0] = row_alloc(r, arch[0]);
-        for(size_t i = 1; i < arch.size(); ++i) {
-            nn.ws[i - 1] = Mat::alloc(r, nn.as[i - 1].cols, arch[i]);
-            nn.bs[i - 1] = row_alloc(r, arch[i]);
-            nn.as[i] = row_alloc(r, arch[i]);
+        const size_t n = a.cols;
+        for(size_t i = 0; i < dst.rows; ++i) {
+            const float* ar = a.elements + i * a.stride;
+            float* dr = dst.elements + i * dst.stride;
+            bool sparse = sparse_enough(ar, n);
+            for(size_t p = 0; p < b.count(); ++p) {
+                const float* panel = b.elements + p * n * NN_PANEL;
+                float acc[NN_PANEL] = {};
+                auto axpy = [&](size_t k) {
+                    for(size_t jj = 0; jj < NN_PANEL; ++jj)
+                        acc[jj] += ar[k] * panel[k * NN_PANEL + jj];
+                };
+                if(sparse) {
+                    for_nonzero(ar, n, axpy);
+                } else {
+                    for(size_t k = 0; k < n; ++k)
+                        axpy(k);
+                }
+                size_t w = std::min<size_t>(NN_PANEL, b.cols - p * NN_PANEL);
+                for(size_t jj = 0; jj < w; ++jj)
+                    dr[p * NN_PANEL + jj] = acc[jj];
+            }
         }
+    }
+};
 
-        return nn;
+// bfloat16, the upper half of an IEEE float: the same range with 8 bits of
+// mantissa. Converting from float rounds to nearest even.
+struct bf16 {
+    uint16_t bits;
+
+    bf16() = default;
+    bf16(float x) {
+        uint32_t u = std::bit_cast<uint32_t>(x);
+        if((u & 0x7FFFFFFF) > 0x7F800000)
+            bits = (u >> 16) | 0x40; // Keep NaN a NaN
+        else
+            bits = (u + 0x7FFF + ((u >> 16) & 1)) >> 16;
     }
-    void zero() {
-        for(size_t i = 0; i < arch_count - 1; ++i) {
-            ws[i].fill(0);
-            bs[i].fill(0);
-            as[i].fill(0);
-        }
-        as[arch_count - 1].fill(0);
+    operator float() const {
+        return std::bit_cast<float>((uint32_t)bits << 16);
     }
+};
 
-    void print(const char* name) {
-        char buf[256];
-        printf("%s = [\n", name);
-        for(size_t i = 0; i < arch_count - 1; ++i) {
-            snprintf(buf, sizeof(buf), "ws%zu", i);
-            ws[i].print(buf, 4);
-            snprintf(buf, sizeof(buf), "bs%zu", i);
-            row_print(bs[i], buf, 4);
+#if __has_include(<stdfloat>)
+#include <stdfloat>
+#endif
+#ifdef __STDCPP_FLOAT16_T__
+#define NN_HAS_FLOAT16
+#endif // __STDCPP_FLOAT16_T__
+
+// Storage type of NN::keep_half() weights and half checkpoints. bf16 keeps
+// the range of float, std::float16_t keeps 3 more mantissa bits but
+// overflows past 65504. Define NN_HALF_FLOAT16 to pick the latter.
+#ifndef NN_HALF
+#if defined(NN_HALF_FLOAT16) && defined(NN_HAS_FLOAT16)
+#define NN_HALF std::float16_t
+#elif defined(NN_HALF_FLOAT16)
+#error "NN_HALF_FLOAT16 needs std::float16_t"
+#else
+#define NN_HALF bf16
+#endif
+#endif // NN_HALF
+
+// A row-major matrix stored in a narrower type T. Kernels widen the
+// elements to float as they load them and accumulate in float, so only the
+// memory traffic shrinks.
+template <typename T>
+struct Mat_Of {
+    size_t rows;
+    size_t cols;
+    size_t stride;
+    T* elements;
+
+    T& at(size_t i, size_t j) const { return elements[i * stride + j]; }
+
+    static Mat_Of alloc(Region* r, size_t rows, size_t cols) {
+        Mat_Of m;
+        m.rows = rows;
+        m.cols = cols;
+        m.stride = cols;
+        m.elements = (T*)Region::alloc(r, sizeof(T) * rows * cols);
+        NN_ASSERT(m.elements != nullptr);
+        return m;
+    }
+
+    void load(Mat src) {
+        NN_ASSERT(src.rows == rows && src.cols == cols);
+        for(size_t i = 0; i < rows; ++i)
+            for(size_t j = 0; j < cols; ++j)
+                at(i, j) = T(src.at(i, j));
+    }
+
+    void store(Mat dst) const {
+        NN_ASSERT(dst.rows == rows && dst.cols == cols);
+        for(size_t i = 0; i < rows; ++i)
+            for(size_t j = 0; j < cols; ++j)
+                dst.at(i, j) = (float)at(i, j);
+    }
+
+    // Streams b once per row of a like Mat::gemv()
+    static void dot(Mat dst, Mat a, Mat_Of b) {
+        NN_ASSERT(a.cols == b.rows);
+        NN_ASSERT(dst.rows == a.rows);
+        NN_ASSERT(dst.cols == b.cols);
+        NN_ASSERT(dst.layout == Mat::ROW_MAJOR && a.layout == Mat::ROW_MAJOR);
+
+        for(size_t i = 0; i < dst.rows; ++i) {
+            const float* ar = a.elements + i * a.stride;
+            float* dr = dst.elements + i * dst.stride;
+            for(size_t j = 0; j < dst.cols; ++j)
+                dr[j] = 0;
+            for(size_t k = 0; k < b.rows; ++k) {
+                float x = ar[k];
+                const T* br = b.elements + k * b.stride;
+                if constexpr(std::same_as<T, bf16>) {
+                    // Widen from the raw bits so the loop vectorizes
+                    const uint16_t* bits = reinterpret_cast<const uint16_t*>(br);
+                    for(size_t j = 0; j < b.cols; ++j)
+                        dr[j] += x * std::bit_cast<float>((uint32_t)bits[j] << 16);
+                } else {
+                    for(size_t j = 0; j < b.cols; ++j)
+                        dr[j] += x * (float)br[j];
+                }
+            }
+        }
+    }
+};
+
+// Layers pruned below this fraction of non-zero weights are run through
+// Sparse_Mat by NN::keep_sparse(), denser ones stay dense. See prune.cpp for
+// the measurement behind it.
+#ifndef NN_SPARSE_WEIGHTS
+#define NN_SPARSE_WEIGHTS 0.3f
+#endif // NN_SPARSE_WEIGHTS
+
+// The right-hand side of a product with most of its entries zero, stored in
+// CSR by column: the non-zeros of column j are values[begin[j] .. begin[j + 1])
+// at rows index[...] in increasing order. That is CSR of the transpose, so
+// every output is a short gathered dot product with no scattered writes.
+struct Sparse_Mat {
+    size_t rows;
+    size_t cols;
+    size_t* begin;
+    uint32_t* index;
+    float* values;
+
+    size_t nonzero() const { return begin[cols]; }
+
+    // The structure follows the non-zeros of `mask`, values come from m
+    template <typename M>
+    static Sparse_Mat alloc(Region* r, Mat m, M mask) {
+        Sparse_Mat s;
+        s.rows = m.rows;
+        s.cols = m.cols;
+        s.begin = (size_t*)Region::alloc(r, sizeof(size_t) * (m.cols + 1));
+        NN_ASSERT(s.begin != nullptr);
+        size_t count = 0;
+        for(size_t j = 0; j < m.cols; ++j) {
+            s.begin[j] = count;
+            for(size_t k = 0; k < m.rows; ++k)
+                count += mask.at(k, j) != 0;
+        }
+        s.begin[m.cols] = count;
+        s.index = (uint32_t*)Region::alloc(r, sizeof(uint32_t) * count);
+        s.values = (float*)Region::alloc(r, sizeof(float) * count);
+        NN_ASSERT(count == 0 || (s.index != nullptr && s.values != nullptr));
+        for(size_t j = 0, p = 0; j < m.cols; ++j)
+            for(size_t k = 0; k < m.rows; ++k)
+                if(mask.at(k, j) != 0) s.index[p++] = k;
+        s.load(m);
+        return s;
+    }
+
+    // Refreshes the values, the structure stays
+    void load(Mat m) {
+        NN_ASSERT(m.rows == rows && m.cols == cols);
+        for(size_t j = 0; j < cols; ++j)
+            for(size_t p = begin[j]; p < begin[j + 1]; ++p)
+                values[p] = m.at(index[p], j);
+    }
+
+    // Skipping the zeros keeps the order of the remaining products, so the
+    // result equals the dense one
+    static void dot(Mat dst, Mat a, Sparse_Mat b) {
+        NN_ASSERT(a.cols == b.rows);
+        NN_ASSERT(dst.rows == a.rows);
+        NN_ASSERT(dst.cols == b.cols);
+        NN_ASSERT(dst.layout == Mat::ROW_MAJOR && a.layout == Mat::ROW_MAJOR);
+
+        for(size_t i = 0; i < dst.rows; ++i) {
+            const float* ar = a.elements + i * a.stride;
+            float* dr = dst.elements + i * dst.stride;
+            for(size_t j = 0; j < b.cols; ++j) {
+                float acc = 0;
+                for(size_t p = b.begin[j]; p < b.begin[j + 1]; ++p)
+                    acc += ar[b.index[p]] * b.values[p];
+                dr[j] = acc;
+            }
+        }
+    }
+};
+
+// Rows of the input a Low_Rank product pushes through its scratch at once
+#ifndef NN_LOW_RANK_ROWS
+#define NN_LOW_RANK_ROWS 64
+#endif // NN_LOW_RANK_ROWS
+
+// A rows x cols matrix of rank at most `rank` stored as the product u * v,
+// so a product with it costs rank * (rows + cols) instead of rows * cols
+// multiplies per row of the input. See NN::factorize().
+struct Low_Rank {
+    size_t rows;
+    size_t cols;
+    size_t rank;
+    Mat u; // rows x rank
+    Mat v; // rank x cols
+    // Scratch of dot() and step(), so one product or update at a time
+    Mat t;
+    Mat du, dv;
+
+    static Low_Rank alloc(Region* r, size_t rows, size_t cols, size_t rank) {
+        NN_ASSERT(0 < rank && rank <= std::min(rows, cols));
+        return {
+            .rows = rows,
+            .cols = cols,
+            .rank = rank,
+            .u = Mat::alloc(r, rows, rank),
+            .v = Mat::alloc(r, rank, cols),
+            .t = Mat::alloc(r, NN_LOW_RANK_ROWS, rank),
+            .du = Mat::alloc(r, rows, rank),
+            .dv = Mat::alloc(r, rank, cols),
+        };
+    }
+
+    // Fits u * v to the best rank approximation of w by orthogonal (block
+    // power) iteration: u converges to the leading left singular vectors of
+    // w in order of decreasing singular value, and v = u^T * w. Every
+    // singular value is then split evenly between its column of u and row of
+    // v, so that step() moves both at a similar rate.
+    void factor(Region* r, Mat w, size_t iterations) {
+        NN_ASSERT(w.rows == rows && w.cols == cols);
+        Region::Scope scope{r};
+        Region::Tagged tagged{r, Region::SCRATCH};
+        // The iteration needs w transposed, which a BLOCKED view can not be
+        if(w.layout == Mat::BLOCKED) {
+            Mat copy = Mat::alloc(r, rows, cols);
+            Mat::copy(copy, w);
+            w = copy;
+        }
+        Mat z = Mat::alloc(r, cols, rank);
+        u.rand(-1, 1);
+        orthonormalize(u);
+        for(size_t it = 0; it < iterations; ++it) {
+            Mat::dot(z, w.transpose(), u);
+            Mat::dot(u, w, z);
+            orthonormalize(u);
+        }
+        Mat::dot(v, u.transpose(), w);
+        for(size_t q = 0; q < rank; ++q) {
+            float sigma = 0;
+            for(size_t j = 0; j < cols; ++j)
+                sigma += v.at(q, j) * v.at(q, j);
+            sigma = sqrtf(sqrtf(sigma));
+            if(sigma == 0) continue;
+            for(size_t k = 0; k < rows; ++k)
+                u.at(k, q) *= sigma;
+            for(size_t j = 0; j < cols; ++j)
+                v.at(q, j) /= sigma;
+        }
+    }
+
+    // Modified Gram-Schmidt over the columns of m, projecting twice so the
+    // columns stay orthogonal when they are nearly dependent
+    static void orthonormalize(Mat m) {
+        auto norm = [&](size_t c) {
+            float n = 0;
+            for(size_t k = 0; k < m.rows; ++k)
+                n += m.at(k, c) * m.at(k, c);
+            return sqrtf(n);
+        };
+        for(size_t c = 0; c < m.cols; ++c) {
+            float before = norm(c);
+            for(size_t pass = 0; pass < 2; ++pass)
+                for(size_t p = 0; p < c; ++p) {
+                    float d = 0;
+                    for(size_t k = 0; k < m.rows; ++k)
+                        d += m.at(k, c) * m.at(k, p);
+                    for(size_t k = 0; k < m.rows; ++k)
+                        m.at(k, c) -= d * m.at(k, p);
+                }
+            // A column (numerically) inside the span of the previous ones is
+            // zeroed, the rank of w is lower than asked
+            float n = norm(c);
+            float s = n > 1e-4f * before ? 1 / n : 0;
+            for(size_t k = 0; k < m.rows; ++k)
+                m.at(k, c) *= s;
+        }
+    }
+
+    // The first k of the factors, e.g. to measure smaller ranks after
+    // factoring once at the largest
+    Low_Rank prefix(size_t k) const {
+        NN_ASSERT(0 < k && k <= rank);
+        Low_Rank p = *this;
+        p.rank = k;
+        p.u = u.slice_cols(0, k);
+        p.v = v.slice_rows(0, k);
+        p.t = t.slice_cols(0, k);
+        p.du = du.slice_cols(0, k);
+        p.dv = dv.slice_rows(0, k);
+        return p;
+    }
+
+    void expand(Mat w) const {
+        Mat::dot(w, u, v);
+    }
+
+    // ||w - u * v|| / ||w||, Frobenius
+    float error(Mat w) const {
+        NN_ASSERT(w.rows == rows && w.cols == cols);
+        float diff = 0, norm = 0;
+        for(size_t k = 0; k < rows; ++k)
+            for(size_t j = 0; j < cols; ++j) {
+                float x = 0;
+                for(size_t q = 0; q < rank; ++q)
+                    x += u.at(k, q) * v.at(q, j);
+                diff += (w.at(k, j) - x) * (w.at(k, j) - x);
+                norm += w.at(k, j) * w.at(k, j);
+            }
+        return norm > 0 ? sqrtf(diff / norm) : 0;
+    }
+
+    // Moves the factors by scale times the gradient of the product: with g
+    // the gradient of u * v, u gets g * v^T and v gets u^T * g
+    void step(Mat g, float scale) {
+        NN_ASSERT(g.rows == rows && g.cols == cols);
+        Mat::dot(du, g, v.transpose());
+        Mat::dot(dv, u.transpose(), g);
+        for(size_t k = 0; k < rows; ++k)
+            for(size_t q = 0; q < rank; ++q)
+                u.at(k, q) += scale * du.at(k, q);
+        for(size_t q = 0; q < rank; ++q)
+            for(size_t j = 0; j < cols; ++j)
+                v.at(q, j) += scale * dv.at(q, j);
+    }
+
+    // Two thin products through t, NN_LOW_RANK_ROWS rows of a at a time
+    static void dot(Mat dst, Mat a, Low_Rank b) {
+        NN_ASSERT(a.cols == b.rows);
+        NN_ASSERT(dst.rows == a.rows);
+        NN_ASSERT(dst.cols == b.cols);
+        for(size_t i = 0; i < a.rows; i += b.t.rows) {
+            size_t n = std::min(b.t.rows, a.rows - i);
+            Mat t = b.t.slice_rows(0, n);
+            Mat::dot(t, a.slice_rows(i, n), b.u);
+            Mat::dot(dst.slice_rows(i, n), t, b.v);
+        }
+    }
+};
+
+// Expression templates. Arithmetic on Mat, Row and float does not compute
+// anything, it builds a tree of Expr_* nodes that Mat::assign(), += and -=
+// evaluate in a single fused loop without temporaries:
+//
+//     w -= rate * g;              // one pass over w and g
+//     a.assign(act(x * W + b));   // GEMM, then bias and activation in one pass
+//
+// `*` of two matrices is the matrix product (Expr_Dot), `*` with a float
+// scales elementwise. A Row operand has a single row and is broadcast over
+// the rows of the destination, like the biases are. A matrix product can
+// only appear once in an assign() since it is computed straight into the
+// destination, and every other node then reads the destination elementwise.
+// So with a product the destination must not overlap any operand, as in
+// dst.assign(x * W + dst), which asserts; without one it may.
+// When the destination and all the operands are row-major, the loop runs
+// over raw row pointers so the compiler can vectorize it like hand-written
+// code; any other layout falls back to Mat::at().
+struct Expr_Base { };
+
+template <typename T>
+concept Expr_Node = std::derived_from<T, Expr_Base>;
+
+template <typename T>
+concept Expr_Operand = Expr_Node<T> || std::same_as<T, Mat> || std::same_as<T, Row>;
+
+template <typename T>
+concept Expr_Term = Expr_Operand<T> || std::is_arithmetic_v<T>;
+
+struct Expr_Scalar : Expr_Base {
+    float x;
+    static constexpr bool has_dot = false;
+    size_t rows() const { return 0; }
+    size_t cols() const { return 0; }
+    bool row_major() const { return true; }
+    void prepare(Mat) { }
+    bool overlaps(Mat) const { return false; }
+    float at(size_t, size_t) const { return x; }
+    auto row(size_t) const {
+        return [x = x](size_t) { return x; };
+    }
+};
+
+struct Expr_Mat : Expr_Base {
+    Mat m;
+    static constexpr bool has_dot = false;
+    size_t rows() const { return m.rows; }
+    size_t cols() const { return m.cols; }
+    bool row_major() const { return m.layout == Mat::ROW_MAJOR; }
+    void prepare(Mat) { }
+    bool overlaps(Mat dst) const { return Mat::overlap(m, dst); }
+    float at(size_t i, size_t j) const { return m.at(i, j); }
+    auto row(size_t i) const {
+        const float* p = m.elements + i * m.stride;
+        return [p](size_t j) { return p[j]; };
+    }
+};
+
+struct Expr_Row : Expr_Base {
+    Row r;
+    static constexpr bool has_dot = false;
+    size_t rows() const { return 0; }
+    size_t cols() const { return r.cols; }
+    bool row_major() const { return true; }
+    void prepare(Mat) { }
+    bool overlaps(Mat dst) const { return Mat::overlap(Mat::view(r.elements, 1, r.cols), dst); }
+    float at(size_t, size_t j) const { return r.elements[j]; }
+    auto row(size_t) const {
+        const float* p = r.elements;
+        return [p](size_t j) { return p[j]; };
+    }
+};
+
+// B is anything with a static B::dot(Mat dst, Mat a, B b): a Mat, Panels,
+// Mat_Of<T>, Sparse_Mat or Low_Rank, see Expr_Dot_Operand
+template <typename B>
+struct Expr_Dot : Expr_Base {
+    Mat a;
+    B b;
+    Mat result;
+    static constexpr bool has_dot = true;
+    size_t rows() const { return a.rows; }
+    size_t cols() const { return b.cols; }
+    bool row_major() const { return result.layout == Mat::ROW_MAJOR; }
+    void prepare(Mat dst) {
+        B::dot(dst, a, b);
+        result = dst;
+    }
+    bool overlaps(Mat dst) const {
+        if constexpr(std::same_as<B, Mat>)
+            if(Mat::overlap(b, dst)) return true;
+        return Mat::overlap(a, dst);
+    }
+    float at(size_t i, size_t j) const { return result.at(i, j); }
+    auto row(size_t i) const {
+        const float* p = result.elements + i * result.stride;
+        return [p](size_t j) { return p[j]; };
+    }
+};
+
+template <typename Op, typename A, typename B>
+struct Expr_Binary : Expr_Base {
+    A a;
+    B b;
+    static constexpr bool has_dot = A::has_dot || B::has_dot;
+    static_assert(!(A::has_dot && B::has_dot), "Only one matrix product per expression");
+    size_t rows() const { return a.rows() != 0 ? a.rows() : b.rows(); }
+    size_t cols() const { return a.cols() != 0 ? a.cols() : b.cols(); }
+    bool row_major() const { return a.row_major() && b.row_major(); }
+    void prepare(Mat dst) {
+        NN_ASSERT(a.rows() == 0 || b.rows() == 0 || a.rows() == b.rows());
+        NN_ASSERT(a.cols() == 0 || b.cols() == 0 || a.cols() == b.cols());
+        a.prepare(dst);
+        b.prepare(dst);
+    }
+    bool overlaps(Mat dst) const { return a.overlaps(dst) || b.overlaps(dst); }
+    float at(size_t i, size_t j) const { return Op{}(a.at(i, j), b.at(i, j)); }
+    auto row(size_t i) const {
+        return [ra = a.row(i), rb = b.row(i)](size_t j) { return Op{}(ra(j), rb(j)); };
+    }
+};
+
+template <typename A>
+struct Expr_Act : Expr_Base {
+    A a;
+    static constexpr bool has_dot = A::has_dot;
+    size_t rows() const { return a.rows(); }
+    size_t cols() const { return a.cols(); }
+    bool row_major() const { return a.row_major(); }
+    void prepare(Mat dst) { a.prepare(dst); }
+    bool overlaps(Mat dst) const { return a.overlaps(dst); }
+    float at(size_t i, size_t j) const { return NN_ACT.actf(a.at(i, j)); }
+    auto row(size_t i) const {
+        return [ra = a.row(i)](size_t j) { return NN_ACT.actf(ra(j)); };
+    }
+};
+
+inline Expr_Mat expr(Mat m) { return {{}, m}; }
+inline Expr_Row expr(Row r) { return {{}, r}; }
+inline Expr_Scalar expr(float x) { return {{}, x}; }
+template <Expr_Node E>
+E expr(E e) { return e; }
+
+template <Expr_Term A, Expr_Term B>
+    requires Expr_Operand<A> || Expr_Operand<B>
+auto operator+(A a, B b) {
+    return Expr_Binary<std::plus<>, decltype(expr(a)), decltype(expr(b))>{{}, expr(a), expr(b)};
+}
+
+template <Expr_Term A, Expr_Term B>
+    requires Expr_Operand<A> || Expr_Operand<B>
+auto operator-(A a, B b) {
+    return Expr_Binary<std::minus<>, decltype(expr(a)), decltype(expr(b))>{{}, expr(a), expr(b)};
+}
+
+template <typename A, Expr_Operand B>
+    requires std::is_arithmetic_v<A>
+auto operator*(A a, B b) {
+    return Expr_Binary<std::multiplies<>, Expr_Scalar, decltype(expr(b))>{{}, expr((float)a), expr(b)};
+}
+
+template <Expr_Operand A, typename B>
+    requires std::is_arithmetic_v<B>
+auto operator*(A a, B b) {
+    return (float)b * a;
+}
+
+template <typename B>
+concept Expr_Dot_Operand = requires(Mat dst, Mat a, B b) { B::dot(dst, a, b); };
+
+template <Expr_Dot_Operand B>
+Expr_Dot<B> operator*(Mat a, B b) { return {{}, a, b, {}}; }
+template <Expr_Dot_Operand B>
+Expr_Dot<B> operator*(Row a, B b) { return {{}, a.as_mat(), b, {}}; }
+
+template <Expr_Operand A>
+auto act(A a) {
+    return Expr_Act<decltype(expr(a))>{{}, expr(a)};
+}
+
+template <typename E, typename F>
+void expr_eval(Mat dst, E e, F store) {
+    NN_ASSERT(e.rows() == 0 || e.rows() == dst.rows);
+    NN_ASSERT(e.cols() == 0 || e.cols() == dst.cols);
+    if constexpr(E::has_dot)
+        NN_ASSERT(!e.overlaps(dst) && "The matrix product would overwrite an operand before it is read");
+    e.prepare(dst);
+    if(dst.layout == Mat::ROW_MAJOR && e.row_major()) {
+        for(size_t i = 0; i < dst.rows; ++i) {
+            float* d = dst.elements + i * dst.stride;
+            auto r = e.row(i);
+            for(size_t j = 0; j < dst.cols; ++j)
+                store(d[j], r(j));
+        }
+        return;
+    }
+    for(size_t i = 0; i < dst.rows; ++i)
+        for(size_t j = 0; j < dst.cols; ++j)
+            store(dst.at(i, j), e.at(i, j));
+}
+
+template <typename E>
+Mat& Mat::assign(E e) {
+    expr_eval(*this, expr(e), [](float& d, float x) { d = x; });
+    return *this;
+}
+
+template <typename E>
+Mat& Mat::operator+=(E e) {
+    static_assert(!decltype(expr(e))::has_dot, "The matrix product would overwrite the destination before it is read");
+    expr_eval(*this, expr(e), [](float& d, float x) { d += x; });
+    return *this;
+}
+
+template <typename E>
+Mat& Mat::operator-=(E e) {
+    static_assert(!decltype(expr(e))::has_dot, "The matrix product would overwrite the destination before it is read");
+    expr_eval(*this, expr(e), [](float& d, float x) { d -= x; });
+    return *this;
+}
+
+inline void Mat::act() {
+    assign(::act(*this));
+}
+
+template <typename E>
+Row& Row::assign(E e) {
+    as_mat().assign(e);
+    return *this;
+}
+
+template <typename E>
+Row& Row::operator+=(E e) {
+    as_mat() += e;
+    return *this;
+}
+
+template <typename E>
+Row& Row::operator-=(E e) {
+    as_mat() -= e;
+    return *this;
+}
+
+// #define ROW_AT(row, col) (row).elements[col]
+// void Mat::dot(Mat dst, Mat a, Mat b);
+// Mat row_as_mat(Row row);
+#define row_alloc(r, cols) Mat::row(Mat::alloc(r, 1, cols), 0)
+Row row_slice(Row row, size_t i, size_t cols);
+// #define row_rand(row, low, high)      mat_rand(row_as_mat(row), low, high)
+// #define row_fill(row, x)              row_as_mat(row).fill(x);
+#define row_print(row, name, padding) row.as_mat().print(name, padding)
+#define row_copy(dst, src)            Mat::copy(dst.as_mat(), src.as_mat())
+
+// #define m[i][j] (m).elements[(i) * (m).cols + (j)]
+// Mat mat_alloc(Region* r, size_t rows, size_t cols);
+// void mat_fill(Mat m, float x);
+// void mat_rand(Mat m, float low, float high);
+// Row mat_row(Mat m, size_t row);
+// void mat_copy(Mat dst, Mat src);
+// void Mat::dot(Mat dst, Mat a, Mat b);
+// void mat_sum(Mat dst, Mat a);
+// void mat_act(Mat m);
+// void mat_print(Mat m, const char* name, size_t padding);
+// void mat_shuffle_rows(Mat m);
+#define MAT_PRINT(m) m.print(#m, 0)
+
+#ifndef NN_TUNE_DIR
+#define NN_TUNE_DIR "."
+#endif // NN_TUNE_DIR
+
+// Finds the dot_tiles that run the layer products of a network fastest on
+// this machine, for the batched products of forward_rows() and backprop as
+// well as the single-row ones of forward(). init() is meant to be called
+// once at startup: the first run on a host sweeps the candidates and writes
+// the winner to a per-host profile in NN_TUNE_DIR, later runs just load it.
+struct Dot_Tuner {
+    static void profile_path(char* buf, size_t size) {
+        char host[256] = "default";
+#if defined(__unix__) || defined(__APPLE__)
+        if(gethostname(host, sizeof(host)) != 0) strcpy(host, "default");
+        host[sizeof(host) - 1] = '\0';
+#endif
+        snprintf(buf, size, "%s/nn_dot.%s.profile", NN_TUNE_DIR, host);
+    }
+
+    static bool load(const char* path) {
+        FILE* f = fopen(path, "r");
+        if(f == nullptr) return false;
+        Dot_Tiles t;
+        int single = 0, batch = 0;
+        bool ok = fscanf(f, "%zu %zu %zu %zu %zu %d %d", &t.k, &t.j, &t.unroll, &t.gemv_j, &t.parallel, &single, &batch) == 7
+            && t.k > 0 && t.j > 0;
+        fclose(f);
+        t.pack_single = single != 0;
+        t.pack_batch = batch != 0;
+        if(ok) dot_tiles = t;
+        return ok;
+    }
+
+    static bool save(const char* path) {
+        FILE* f = fopen(path, "w");
+        if(f == nullptr) return false;
+        fprintf(f, "%zu %zu %zu %zu %zu %d %d\n", dot_tiles.k, dot_tiles.j, dot_tiles.unroll,
+            dot_tiles.gemv_j, dot_tiles.parallel, (int)dot_tiles.pack_single, (int)dot_tiles.pack_batch);
+        return fclose(f) == 0;
+    }
+
+    // Short runs, the sweep times over a hundred candidates
+    template <typename F>
+    static double measure(F f) {
+        return seconds_per_call(f, Chrono::milliseconds(10));
+    }
+
+    // Times every candidate on the `rows` x arch[l] by arch[l] x arch[l + 1]
+    // products and on their first rows alone, with and without Panels, and
+    // makes the fastest one current
+    static Dot_Tiles tune(Region* r, std::span<const size_t> arch, size_t rows) {
+        NN_ASSERT(arch.size() > 1);
+        NN_ASSERT(rows > 0);
+        Region::Scope scope{r};
+        Region::Tagged tagged{r, Region::SCRATCH};
+
+        size_t L = arch.size() - 1;
+        Mat* as = (Mat*)Region::alloc(r, sizeof(Mat) * L);
+        Mat* bs = (Mat*)Region::alloc(r, sizeof(Mat) * L);
+        Mat* ds = (Mat*)Region::alloc(r, sizeof(Mat) * L);
+        Panels* ps = (Panels*)Region::alloc(r, sizeof(Panels) * L);
+        NN_ASSERT(as != nullptr && bs != nullptr && ds != nullptr && ps != nullptr);
+        for(size_t l = 0; l < L; ++l) {
+            as[l] = Mat::alloc(r, rows, arch[l]);
+            bs[l] = Mat::alloc(r, arch[l], arch[l + 1]);
+            ds[l] = Mat::alloc(r, rows, arch[l + 1]);
+            as[l].rand(-1, 1);
+            bs[l].rand(-1, 1);
+            ps[l] = Panels::alloc(r, arch[l], arch[l + 1]);
+            ps[l].pack(bs[l]);
+        }
+        auto batch = [&](Dot_Tiles t) {
+            return measure([&] {
+                for(size_t l = 0; l < L; ++l)
+                    Mat::dot_tiled(ds[l], as[l], bs[l], t);
+            });
+        };
+        auto single = [&](Dot_Tiles t) {
+            return measure([&] {
+                for(size_t l = 0; l < L; ++l)
+                    Mat::gemv_tiled(ds[l].slice_rows(0, 1), as[l].slice_rows(0, 1), bs[l], t);
+            });
+        };
+        auto packed = [&](size_t n) {
+            return measure([&] {
+                for(size_t l = 0; l < L; ++l)
+                    Panels::dot(ds[l].slice_rows(0, n), as[l].slice_rows(0, n), ps[l]);
+            });
+        };
+
+        Dot_Tiles best = dot_tiles;
+        auto best_time = batch(best);
+        for(size_t k: {32, 64, 128, 256, 512})
+            for(size_t j: {64, 128, 256, 512, 1024})
+                for(size_t unroll: {1, 2, 4, 8}) {
+                    Dot_Tiles t = best;
+                    t.k = k;
+                    t.j = j;
+                    t.unroll = unroll;
+                    auto time = batch(t);
+                    if(time < best_time) {
+                        best = t;
+                        best_time = time;
+                    }
+                }
+
+        // The column blocks of the single-row kernel, on one thread
+        best.parallel = SIZE_MAX;
+        auto single_time = single(best);
+        for(size_t j: {0, 64, 128, 256, 512, 1024}) {
+            Dot_Tiles t = best;
+            t.gemv_j = j;
+            auto time = single(t);
+            if(time < single_time) {
+                best = t;
+                single_time = time;
+            }
+        }
+
+        // Threads pay off from the smallest layer they speed up. Without
+        // one, the layers tried bound it from below.
+        size_t parallel = SIZE_MAX, largest = 0;
+        for(size_t l = 0; l < L && Thread_Pool::get().threads() > 1; ++l) {
+            size_t weights = arch[l] * arch[l + 1];
+            largest = std::max(largest, weights);
+            Dot_Tiles serial = best, threaded = best;
+            threaded.parallel = 0;
+            Mat d = ds[l].slice_rows(0, 1), a = as[l].slice_rows(0, 1);
+            auto serial_time = measure([&] { Mat::gemv_tiled(d, a, bs[l], serial); });
+            auto threaded_time = measure([&] { Mat::gemv_tiled(d, a, bs[l], threaded); });
+            if(threaded_time < serial_time) parallel = std::min(parallel, weights);
+        }
+        best.parallel = parallel != SIZE_MAX ? parallel : std::max<size_t>(NN_GEMV_PARALLEL, largest + 1);
+
+        best.pack_single = packed(1) < single(best);
+        best.pack_batch = packed(rows) < batch(best);
+
+        dot_tiles = best;
+        return best;
+    }
+
+    // Loads this host's profile, tuning and saving a new one when there is
+    // none yet or `retune` is set
+    static Dot_Tiles init(Region* r, std::span<const size_t> arch, size_t rows, bool retune = false) {
+        char path[512];
+        profile_path(path, sizeof(path));
+        if(!retune && load(path)) return dot_tiles;
+        tune(r, arch, rows);
+        if(!save(path))
+            fprintf(stderr, "WARNING: could not save the dot profile to %s\n", path);
+        return dot_tiles;
+    }
+};
+
+// Training data with the inputs and the targets in two matrices of the same
+// number of rows. Rows of x are fed to the network in place, without being
+// copied into its input. split() views a combined [inputs | targets] matrix
+// without copying, alloc() gives x and y their own contiguous storage.
+struct Dataset {
+    Mat x, y;
+
+    size_t size() const { return x.rows; }
+
+    static Dataset alloc(Region* r, size_t rows, size_t inputs, size_t outputs) {
+        Region::Tagged tagged{r, Region::DATASET};
+        return {
+            .x = Mat::alloc(r, rows, inputs),
+            .y = Mat::alloc(r, rows, outputs),
+        };
+    }
+
+    static Dataset split(Mat t, size_t inputs) {
+        NN_ASSERT(inputs <= t.cols);
+        return {
+            .x = t.slice_cols(0, inputs),
+            .y = t.slice_cols(inputs, t.cols - inputs),
+        };
+    }
+
+    Dataset slice_rows(size_t begin, size_t n) const {
+        return {
+            .x = x.slice_rows(begin, n),
+            .y = y.slice_rows(begin, n),
+        };
+    }
+
+    void shuffle_rows() {
+        NN_ASSERT(x.rows == y.rows);
+        for(size_t i = 0; i < x.rows; ++i) {
+            size_t j = i + ::rand() % (x.rows - i);
+            if(i == j) continue;
+            for(size_t k = 0; k < x.cols; ++k)
+                std::swap(x.at(i, k), x.at(j, k));
+            for(size_t k = 0; k < y.cols; ++k)
+                std::swap(y.at(i, k), y.at(j, k));
+        }
+    }
+};
+
+// Liveness-based placement of the per-sample activation buffers.
+//
+// The schedule is the forward pass followed, when training, by the backward
+// pass. With L = arch.size() - 1, the input is written at t = 0, forward
+// layer i runs at t = i + 1 and backward layer l at t = 2L + 1 - l. Every
+// buffer lives from the step that writes it to the last step that reads it,
+// and buffers with disjoint lifetimes are placed at the same offset of one
+// arena. At inference time that boils down to ping-pong activations, the
+// input stays live throughout so callers can update part of it between
+// forward() calls.
+//
+// Buffer i <= L is the activation of layer i. When training, buffer L + l is
+// the delta (cost gradient) of layer l >= 1; the input never needs one, and
+// its buffer is empty because backprop() binds it straight to the samples.
+struct Mem_Plan {
+    enum Mode {
+        INFERENCE,
+        TRAINING,
+    } mode;
+    size_t count;
+    size_t* sizes; // in floats
+    size_t* first;
+    size_t* last;
+    size_t* offsets; // in floats from the start of the arena
+    size_t naive;    // floats needed if every buffer had its own memory
+    size_t planned;  // floats in the arena
+
+    static Mem_Plan make(Region* r, std::span<const size_t> arch, Mode mode) {
+        NN_ASSERT(arch.size() > 1);
+        size_t L = arch.size() - 1;
+
+        Mem_Plan p;
+        p.mode = mode;
+        p.count = mode == TRAINING ? 2 * L + 1 : L + 1;
+        p.sizes = (size_t*)Region::alloc(r, sizeof(size_t) * p.count * 4);
+        NN_ASSERT(p.sizes != nullptr);
+        p.first = p.sizes + p.count;
+        p.last = p.first + p.count;
+        p.offsets = p.last + p.count;
+
+        auto backward = [L](size_t l) { return 2 * L + 1 - l; };
+        for(size_t i = 0; i <= L; ++i) {
+            p.sizes[i] = mode == TRAINING && i == 0 ? 0 : arch[i];
+            p.first[i] = i;
+            // Backward layer i reads the activation itself, layer i + 1 reads
+            // it as the previous activation
+            if(mode == TRAINING)
+                p.last[i] = backward(i > 0 ? i : 1);
+            else
+                p.last[i] = i > 0 ? i + 1 : L + 1;
+        }
+        if(mode == TRAINING) {
+            for(size_t l = 1; l <= L; ++l) {
+                p.sizes[L + l] = arch[l];
+                p.first[L + l] = l == L ? backward(L) : backward(l + 1);
+                p.last[L + l] = backward(l);
+            }
+        }
+
+        // Greedy first fit, biggest buffers first
+        size_t* order = (size_t*)Region::alloc(r, sizeof(size_t) * p.count);
+        NN_ASSERT(order != nullptr);
+        for(size_t i = 0; i < p.count; ++i)
+            order[i] = i;
+        std::sort(order, order + p.count, [&p](size_t a, size_t b) {
+            return p.sizes[a] != p.sizes[b] ? p.sizes[a] > p.sizes[b] : a < b;
+        });
+
+        p.naive = 0;
+        p.planned = 0;
+        for(size_t i = 0; i < p.count; ++i) {
+            size_t b = order[i];
+            size_t offset = 0;
+            // Bump the offset past every conflicting buffer until it fits
+            for(bool moved = true; moved;) {
+                moved = false;
+                for(size_t j = 0; j < i; ++j) {
+                    size_t o = order[j];
+                    bool overlap_time = p.first[o] <= p.last[b] && p.first[b] <= p.last[o];
+                    bool overlap_space = p.offsets[o] < offset + p.sizes[b] && offset < p.offsets[o] + p.sizes[o];
+                    if(overlap_time && overlap_space) {
+                        offset = p.offsets[o] + p.sizes[o];
+                        moved = true;
+                    }
+                }
+            }
+            p.offsets[b] = offset;
+            p.naive += p.sizes[b];
+            if(p.planned < offset + p.sizes[b]) p.planned = offset + p.sizes[b];
+        }
+
+        return p;
+    }
+
+    // Allocates the arena and returns the rows of all the buffers in it
+    Row* bind(Region* r) const {
+        Region::Tagged tagged{r, Region::ACTIVATIONS};
+        float* arena = (float*)Region::alloc(r, sizeof(float) * planned);
+        NN_ASSERT(arena != nullptr);
+        Row* rows = (Row*)Region::alloc(r, sizeof(Row) * count);
+        NN_ASSERT(rows != nullptr);
+        for(size_t i = 0; i < count; ++i) {
+            rows[i].cols = sizes[i];
+            rows[i].elements = arena + offsets[i];
+        }
+        return rows;
+    }
+
+    void print(const char* name) const {
+        size_t L = mode == TRAINING ? (count - 1) / 2 : count - 1;
+        printf("%s = [\n", name);
+        for(size_t i = 0; i < count; ++i)
+            printf("    %s%zu: %zu floats at %zu, live [%zu, %zu]\n",
+                i <= L ? "as" : "ds", i <= L ? i : i - L, sizes[i], offsets[i], first[i], last[i]);
+        printf("]\n");
+        printf("%s: naive peak %zu bytes, planned peak %zu bytes\n", name, naive * sizeof(float), planned * sizeof(float));
+    }
+};
+
+// Rows forward_rows() pushes through every layer at a time
+#ifndef NN_FORWARD_ROWS
+#define NN_FORWARD_ROWS 64
+#endif // NN_FORWARD_ROWS
+
+struct NN {
+    size_t* arch; // A copy in the network's region, shrink() rewrites it
+    size_t arch_count;
+    Mat* ws; // The amount of activations is arch_count-1
+    Row* bs; // The amount of activations is arch_count-1
+    // ws transposed, so the backward pass walks the weights feeding a neuron
+    // contiguously. nullptr unless keep_transposed() was called.
+    Mat* wts;
+
+    // Shared by every copy of the network. `version` is bumped by each change
+    // to the parameters made through NN, code writing ws directly has to call
+    // touch(). The keep_packed() panels and keep_half() copies are
+    // refreshed lazily once it moves.
+    struct Cache {
+        size_t version;
+        size_t packed_version;
+        Panels* panels;
+        size_t half_version;
+        Mat_Of<NN_HALF>* halves;
+        // Non-zero where a weight survived prune(), nullptr if never pruned
+        Mat_Of<uint8_t>* masks;
+        size_t sparse_version;
+        Sparse_Mat* sparse; // Dense layers have no values
+        // Set by factorize(), rank 0 where the layer is not factored
+        Low_Rank* factors;
+    };
+    Cache* cache;
+
+    // TODO: maybe remove these? It would be better to allocate them in a
+    // temporary region during the actual forwarding
+    Row* as;
+
+    // Parameters are charged to `tag`, activations to Region::ACTIVATIONS
+    // unless the whole network is a gradient
+    static NN alloc(Region* r, std::span<const size_t> arch, Region::Tag tag = Region::WEIGHTS, Mat::Layout layout = NN_WEIGHTS_LAYOUT) {
+        NN_ASSERT(arch.size() > 0);
+
+        Region::Tagged tagged{r, tag};
+        NN nn;
+        nn.arch_count = arch.size();
+        nn.wts = nullptr;
+        nn.cache = nullptr;
+
+        nn.arch = (decltype(nn.arch))Region::alloc(r, sizeof(*nn.arch) * nn.arch_count);
+        NN_ASSERT(nn.arch != nullptr);
+        std::copy(arch.begin(), arch.end(), nn.arch);
+
+        nn.ws = (decltype(nn.ws))Region::alloc(r, sizeof(*nn.ws) * (nn.arch_count - 1));
+        NN_ASSERT(nn.ws != nullptr);
+        nn.bs = (decltype(nn.bs))Region::alloc(r, sizeof(*nn.bs) * (nn.arch_count - 1));
+        NN_ASSERT(nn.bs != nullptr);
+        for(size_t i = 1; i < arch.size(); ++i) {
+            nn.ws[i - 1] = Mat::alloc(r, arch[i - 1], arch[i], layout);
+            nn.bs[i - 1] = row_alloc(r, arch[i]);
+        }
+
+        // Gradients carry no activations, backprop keeps its deltas in a
+        // planned scratch arena
+        if(tag == Region::GRADIENTS) {
+            nn.as = nullptr;
+            return nn;
+        }
+
+        nn.cache = (decltype(nn.cache))Region::alloc(r, sizeof(*nn.cache));
+        NN_ASSERT(nn.cache != nullptr);
+        *nn.cache = {};
+
+        Region::Tagged activations{r, Region::ACTIVATIONS};
+        nn.as = (decltype(nn.as))Region::alloc(r, sizeof(*nn.as) * nn.arch_count);
+        NN_ASSERT(nn.as != nullptr);
+        for(size_t i = 0; i < arch.size(); ++i)
+            nn.as[i] = row_alloc(r, arch[i]);
+
+        return nn;
+    }
+    void zero() {
+        for(size_t i = 0; i < arch_count - 1; ++i) {
+            ws[i].fill(0);
+            bs[i].fill(0);
+        }
+        if(as != nullptr)
+            for(size_t i = 0; i < arch_count; ++i)
+                as[i].fill(0);
+    }
+
+    // A network sharing the parameters but with its activations placed by
+    // Mem_Plan::INFERENCE. Hidden activations two layers apart share memory,
+    // so only the input and output can be read after forward().
+    NN inference(Region* r) const {
+        NN nn = *this;
+        nn.as = Mem_Plan::make(r, {arch, arch_count}, Mem_Plan::INFERENCE).bind(r);
+        return nn;
+    }
+
+    // Moves the weights into freshly allocated storage of another layout.
+    // Everything indexes the weights through Mat::at(), so no call site cares.
+    void relayout(Region* r, Mat::Layout layout) {
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        for(size_t i = 0; i < arch_count - 1; ++i) {
+            Mat w = Mat::alloc(r, ws[i].rows, ws[i].cols, layout);
+            Mat::copy(w, ws[i]);
+            ws[i] = w;
+        }
+    }
+
+    // Keeps a transposed copy of the weights for backprop(). learn() and
+    // add() apply every update to both copies, anything else writing ws
+    // directly has to call sync_transposed() afterwards.
+    void keep_transposed(Region* r) {
+        if(wts != nullptr) return;
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        wts = (decltype(wts))Region::alloc(r, sizeof(*wts) * (arch_count - 1));
+        NN_ASSERT(wts != nullptr);
+        for(size_t i = 0; i < arch_count - 1; ++i)
+            wts[i] = Mat::alloc(r, ws[i].cols, ws[i].rows);
+        sync_transposed();
+    }
+
+    // Keeps the weights packed into column panels for forward() and
+    // forward_layer(), see Panels. They skip packing until the next touch().
+    void keep_packed(Region* r) {
+        NN_ASSERT(cache != nullptr);
+        if(cache->panels != nullptr) return;
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        cache->panels = (Panels*)Region::alloc(r, sizeof(Panels) * (arch_count - 1));
+        NN_ASSERT(cache->panels != nullptr);
+        for(size_t i = 0; i < arch_count - 1; ++i)
+            cache->panels[i] = Panels::alloc(r, ws[i].rows, ws[i].cols);
+        cache->packed_version = cache->version - 1;
+    }
+
+    // The packed weights brought up to date, or nullptr without keep_packed()
+    const Panels* packed() {
+        if(cache == nullptr || cache->panels == nullptr) return nullptr;
+        if(cache->packed_version != cache->version) {
+            for(size_t i = 0; i < arch_count - 1; ++i)
+                cache->panels[i].pack(ws[i]);
+            cache->packed_version = cache->version;
+        }
+        return cache->panels;
+    }
+
+    // Keeps an NN_HALF copy of the weights for forward() and forward_layer()
+    // to read instead, halving their memory traffic. The fp32 ws stay the
+    // master copy that learn() updates. Packed panels take precedence.
+    void keep_half(Region* r) {
+        NN_ASSERT(cache != nullptr);
+        if(cache->halves != nullptr) return;
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        cache->halves = (Mat_Of<NN_HALF>*)Region::alloc(r, sizeof(Mat_Of<NN_HALF>) * (arch_count - 1));
+        NN_ASSERT(cache->halves != nullptr);
+        for(size_t i = 0; i < arch_count - 1; ++i)
+            cache->halves[i] = Mat_Of<NN_HALF>::alloc(r, ws[i].rows, ws[i].cols);
+        cache->half_version = cache->version - 1;
+    }
+
+    // The half weights brought up to date, or nullptr without keep_half()
+    const Mat_Of<NN_HALF>* half() {
+        if(cache == nullptr || cache->halves == nullptr) return nullptr;
+        if(cache->half_version != cache->version) {
+            for(size_t i = 0; i < arch_count - 1; ++i)
+                cache->halves[i].load(ws[i]);
+            cache->half_version = cache->version;
+        }
+        return cache->halves;
+    }
+
+    // Zeroes the `fraction` of the weights with the smallest magnitude, in
+    // every layer or over the whole network, and keeps them at zero through
+    // learn(), add() and rand(). Pruning again only removes more weights.
+    void prune(Region* r, float fraction, bool global = false) {
+        NN_ASSERT(cache != nullptr);
+        NN_ASSERT(cache->factors == nullptr && "A factored network cannot be pruned");
+        NN_ASSERT(0 <= fraction && fraction <= 1);
+        const size_t L = arch_count - 1;
+        if(cache->masks == nullptr) {
+            Region::Tagged tagged{r, Region::WEIGHTS};
+            cache->masks = (Mat_Of<uint8_t>*)Region::alloc(r, sizeof(Mat_Of<uint8_t>) * L);
+            NN_ASSERT(cache->masks != nullptr);
+            for(size_t l = 0; l < L; ++l) {
+                cache->masks[l] = Mat_Of<uint8_t>::alloc(r, ws[l].rows, ws[l].cols);
+                std::fill_n(cache->masks[l].elements, ws[l].rows * ws[l].cols, 1);
+            }
+        }
+
+        // The scratch is rewound before keep_sparse() allocates below
+        {
+            Region::Scope scope{r};
+            Region::Tagged tagged{r, Region::SCRATCH};
+            auto threshold = [&](size_t first, size_t last) {
+                size_t count = 0;
+                for(size_t l = first; l < last; ++l)
+                    count += ws[l].rows * ws[l].cols;
+                float* magnitudes = (float*)Region::alloc(r, sizeof(float) * count);
+                NN_ASSERT(magnitudes != nullptr);
+                size_t n = 0;
+                for(size_t l = first; l < last; ++l)
+                    for(size_t k = 0; k < ws[l].rows; ++k)
+                        for(size_t j = 0; j < ws[l].cols; ++j)
+                            magnitudes[n++] = fabsf(ws[l].at(k, j));
+                size_t cut = (size_t)(fraction * count);
+                if(cut == 0) return -1.f;
+                std::nth_element(magnitudes, magnitudes + cut - 1, magnitudes + count);
+                return magnitudes[cut - 1];
+            };
+            auto prune_layers = [&](size_t first, size_t last, float below) {
+                for(size_t l = first; l < last; ++l)
+                    for(size_t k = 0; k < ws[l].rows; ++k)
+                        for(size_t j = 0; j < ws[l].cols; ++j)
+                            if(fabsf(ws[l].at(k, j)) <= below) cache->masks[l].at(k, j) = 0;
+            };
+            if(global) {
+                prune_layers(0, L, threshold(0, L));
+            } else {
+                for(size_t l = 0; l < L; ++l)
+                    prune_layers(l, l + 1, threshold(l, l + 1));
+            }
+        }
+        apply_masks();
+        touch();
+
+        // The sparsity pattern changed, keep_sparse() has to rebuild
+        if(cache->sparse != nullptr) {
+            cache->sparse = nullptr;
+            keep_sparse(r);
+        }
+    }
+
+    void apply_masks() {
+        if(cache == nullptr || cache->masks == nullptr) return;
+        for(size_t l = 0; l < arch_count - 1; ++l)
+            for(size_t k = 0; k < ws[l].rows; ++k)
+                for(size_t j = 0; j < ws[l].cols; ++j)
+                    if(cache->masks[l].at(k, j) == 0) ws[l].at(k, j) = 0;
+        sync_transposed();
+    }
+
+    // Runs the pruned layers sparse below NN_SPARSE_WEIGHTS density, see
+    // Sparse_Mat. Takes precedence over keep_packed() and keep_half().
+    void keep_sparse(Region* r) {
+        NN_ASSERT(cache != nullptr && cache->masks != nullptr && "prune() the network first");
+        if(cache->sparse != nullptr) return;
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        cache->sparse = (Sparse_Mat*)Region::alloc(r, sizeof(Sparse_Mat) * (arch_count - 1));
+        NN_ASSERT(cache->sparse != nullptr);
+        for(size_t l = 0; l < arch_count - 1; ++l) {
+            Mat_Of<uint8_t> mask = cache->masks[l];
+            size_t kept = std::count_if(mask.elements, mask.elements + mask.rows * mask.cols, [](uint8_t m) { return m != 0; });
+            if(kept <= NN_SPARSE_WEIGHTS * mask.rows * mask.cols)
+                cache->sparse[l] = Sparse_Mat::alloc(r, ws[l], mask);
+            else
+                cache->sparse[l] = {};
+        }
+        cache->sparse_version = cache->version;
+    }
+
+    // The sparse layers brought up to date, or nullptr without keep_sparse()
+    const Sparse_Mat* sparse() {
+        if(cache == nullptr || cache->sparse == nullptr) return nullptr;
+        if(cache->sparse_version != cache->version) {
+            for(size_t i = 0; i < arch_count - 1; ++i)
+                if(cache->sparse[i].values != nullptr) cache->sparse[i].load(ws[i]);
+            cache->sparse_version = cache->version;
+        }
+        return cache->sparse;
+    }
+
+    // Removes the hidden neurons that contribute next to nothing: the spread
+    // of their output over `inputs` times the magnitude of their outgoing
+    // weights is at most `threshold`. Such a neuron is dead, saturated or
+    // ignored by the next layer, so its mean output is folded into the next
+    // biases. Then its column of ws[l - 1], entry of bs[l - 1] and row of
+    // ws[l] are cut out and everything is compacted into smaller dense
+    // matrices. Every layer keeps at least one neuron.
+    //
+    // Everything is compacted in place, so nothing is allocated but the
+    // statistics in temp, and every copy of the network, the Cache and arch
+    // included, sees the new shape. Gradients and Batch::accumulate()
+    // buffers keep the old one and have to be allocated again. Returns how
+    // many neurons were removed.
+    size_t shrink(Region* temp, Mat inputs, float threshold) {
+        NN_ASSERT(inputs.cols == arch[0]);
+        NN_ASSERT(inputs.rows > 0);
+        NN_ASSERT((cache == nullptr || cache->factors == nullptr) && "shrink() before factorize()");
+        const size_t L = arch_count - 1;
+        if(L < 2) return 0;
+
+        Region::Scope scope{temp};
+        Region::Tagged scratch{temp, Region::SCRATCH};
+        // Running mean and variance of every hidden neuron (Welford)
+        float** mean = (float**)Region::alloc(temp, sizeof(float*) * L);
+        float** m2 = (float**)Region::alloc(temp, sizeof(float*) * L);
+        bool** keep = (bool**)Region::alloc(temp, sizeof(bool*) * L);
+        size_t* kept = (size_t*)Region::alloc(temp, sizeof(size_t) * arch_count);
+        NN_ASSERT(mean != nullptr && m2 != nullptr && keep != nullptr && kept != nullptr);
+        for(size_t l = 1; l < L; ++l) {
+            mean[l] = (float*)Region::alloc(temp, sizeof(float) * arch[l]);
+            m2[l] = (float*)Region::alloc(temp, sizeof(float) * arch[l]);
+            keep[l] = (bool*)Region::alloc(temp, sizeof(bool) * arch[l]);
+            NN_ASSERT(mean[l] != nullptr && m2[l] != nullptr && keep[l] != nullptr);
+            std::fill_n(mean[l], arch[l], 0.f);
+            std::fill_n(m2[l], arch[l], 0.f);
+        }
+        Row saved = as[0];
+        for(size_t i = 0; i < inputs.rows; ++i) {
+            as[0] = Mat::row(inputs, i);
+            forward();
+            for(size_t l = 1; l < L; ++l)
+                for(size_t j = 0; j < arch[l]; ++j) {
+                    float d = as[l][j] - mean[l][j];
+                    mean[l][j] += d / (i + 1);
+                    m2[l][j] += d * (as[l][j] - mean[l][j]);
+                }
+        }
+        as[0] = saved;
+
+        kept[0] = arch[0];
+        kept[L] = arch[L];
+        size_t removed = 0;
+        for(size_t l = 1; l < L; ++l) {
+            float best = -1;
+            size_t best_j = 0;
+            kept[l] = 0;
+            for(size_t j = 0; j < arch[l]; ++j) {
+                float out = 0;
+                for(size_t m = 0; m < arch[l + 1]; ++m)
+                    out += fabsf(ws[l].at(j, m));
+                float contribution = sqrtf(m2[l][j] / inputs.rows) * out;
+                keep[l][j] = contribution > threshold;
+                kept[l] += keep[l][j];
+                if(contribution > best) {
+                    best = contribution;
+                    best_j = j;
+                }
+            }
+            if(kept[l] == 0) {
+                keep[l][best_j] = true;
+                kept[l] = 1;
+            }
+            removed += arch[l] - kept[l];
+        }
+        if(removed == 0) return 0;
+
+        // Every layer is compacted into the storage it had, at the new shape
+        for(size_t l = 0; l < L; ++l) {
+            const bool* rows = l == 0 ? nullptr : keep[l];
+            const bool* cols = l + 1 == L ? nullptr : keep[l + 1];
+            Mat w = Mat::alloc(temp, kept[l], kept[l + 1]);
+            for(size_t k = 0, k2 = 0; k < arch[l]; ++k) {
+                if(rows != nullptr && !rows[k]) continue;
+                for(size_t j = 0, j2 = 0; j < arch[l + 1]; ++j)
+                    if(cols == nullptr || cols[j]) w.at(k2, j2++) = ws[l].at(k, j);
+                k2 += 1;
+            }
+            for(size_t j = 0, j2 = 0; j < arch[l + 1]; ++j) {
+                if(cols != nullptr && !cols[j]) continue;
+                float bias = bs[l][j];
+                if(rows != nullptr)
+                    for(size_t k = 0; k < arch[l]; ++k)
+                        if(!rows[k]) bias += mean[l][k] * ws[l].at(k, j);
+                bs[l][j2++] = bias;
+            }
+            ws[l] = Mat::view(ws[l].elements, kept[l], kept[l + 1], ws[l].layout);
+            Mat::copy(ws[l], w);
+            bs[l].cols = kept[l + 1];
+            if(wts != nullptr) wts[l] = Mat::view(wts[l].elements, kept[l + 1], kept[l]);
+            if(cache == nullptr) continue;
+
+            // Kept entries only ever move to lower offsets
+            if(cache->masks != nullptr) {
+                Mat_Of<uint8_t>& mask = cache->masks[l];
+                for(size_t k = 0, k2 = 0; k < arch[l]; ++k) {
+                    if(rows != nullptr && !rows[k]) continue;
+                    for(size_t j = 0, j2 = 0; j < arch[l + 1]; ++j)
+                        if(cols == nullptr || cols[j]) mask.elements[k2 * kept[l + 1] + j2++] = mask.at(k, j);
+                    k2 += 1;
+                }
+                mask.rows = kept[l];
+                mask.cols = mask.stride = kept[l + 1];
+            }
+            if(cache->panels != nullptr) {
+                cache->panels[l].rows = kept[l];
+                cache->panels[l].cols = kept[l + 1];
+            }
+            if(cache->halves != nullptr) {
+                cache->halves[l].rows = kept[l];
+                cache->halves[l].cols = cache->halves[l].stride = kept[l + 1];
+            }
+            if(cache->sparse != nullptr && cache->sparse[l].values != nullptr) {
+                Sparse_Mat& sparse = cache->sparse[l];
+                uint32_t* renamed = (uint32_t*)Region::alloc(temp, sizeof(uint32_t) * arch[l]);
+                NN_ASSERT(renamed != nullptr);
+                for(size_t k = 0, k2 = 0; k < arch[l]; ++k)
+                    renamed[k] = rows == nullptr || rows[k] ? k2++ : UINT32_MAX;
+                size_t from = sparse.begin[0], n = 0, j2 = 0;
+                for(size_t j = 0; j < arch[l + 1]; ++j) {
+                    size_t to = sparse.begin[j + 1];
+                    if(cols == nullptr || cols[j]) {
+                        sparse.begin[j2++] = n;
+                        for(size_t p = from; p < to; ++p)
+                            if(renamed[sparse.index[p]] != UINT32_MAX) sparse.index[n++] = renamed[sparse.index[p]];
+                    }
+                    from = to;
+                }
+                sparse.begin[j2] = n;
+                sparse.rows = kept[l];
+                sparse.cols = kept[l + 1];
+            }
+        }
+        if(as != nullptr)
+            for(size_t l = 0; l <= L; ++l)
+                as[l].cols = kept[l];
+        std::copy_n(kept, arch_count, arch);
+
+        // The packed, half and sparse values are reloaded at the new shapes
+        sync_transposed();
+        touch();
+        return removed;
+    }
+
+    // Replaces ws[l] with the rank `rank` product U * V, see Low_Rank, which
+    // forward() and forward_layer() then run as two thin products. ws[l]
+    // keeps the expanded product for backprop(), and learn() and add() move
+    // U and V along its gradient, so training on fine-tunes the factors.
+    // Returns the relative error of the approximation. A factored network
+    // cannot be pruned or shrunk, rand() makes it dense again.
+    float factorize(Region* r, size_t l, size_t rank, size_t iterations = 16) {
+        NN_ASSERT(cache != nullptr);
+        NN_ASSERT(cache->masks == nullptr && "A pruned network cannot be factored");
+        NN_ASSERT(l < arch_count - 1);
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        if(cache->factors == nullptr) {
+            cache->factors = (Low_Rank*)Region::alloc(r, sizeof(Low_Rank) * (arch_count - 1));
+            NN_ASSERT(cache->factors != nullptr);
+            std::fill_n(cache->factors, arch_count - 1, Low_Rank{});
+        }
+        Low_Rank& f = cache->factors[l];
+        f = Low_Rank::alloc(r, ws[l].rows, ws[l].cols, rank);
+        f.factor(r, ws[l], iterations);
+        float error = f.error(ws[l]);
+        f.expand(ws[l]);
+        sync_transposed();
+        touch();
+        return error;
+    }
+
+    // Moves the factors of the factored layers by scale * g and expands them
+    // back into ws
+    void apply_factors(NN g, float scale) {
+        if(cache == nullptr || cache->factors == nullptr) return;
+        for(size_t l = 0; l < arch_count - 1; ++l) {
+            if(cache->factors[l].rank == 0) continue;
+            cache->factors[l].step(g.ws[l], scale);
+            cache->factors[l].expand(ws[l]);
+        }
+        sync_transposed();
+    }
+
+    void touch() {
+        if(cache != nullptr) cache->version += 1;
+    }
+
+    // wts[i] += scale * gw transposed. A BLOCKED gw has no transposed view,
+    // so wts[i] is copied from the updated ws[i] instead.
+    void add_transposed(size_t i, Mat gw, float scale) {
+        if(wts == nullptr) return;
+        if(gw.layout != Mat::BLOCKED) {
+            wts[i] += scale * gw.transpose();
+            return;
+        }
+        for(size_t j = 0; j < ws[i].rows; ++j)
+            for(size_t k = 0; k < ws[i].cols; ++k)
+                wts[i].at(k, j) = ws[i].at(j, k);
+    }
+
+    void sync_transposed() {
+        if(wts == nullptr) return;
+        for(size_t i = 0; i < arch_count - 1; ++i)
+            for(size_t j = 0; j < ws[i].rows; ++j)
+                for(size_t k = 0; k < ws[i].cols; ++k)
+                    wts[i].at(k, j) = ws[i].at(j, k);
+    }
+
+    void print(const char* name) {
+        char buf[256];
+        printf("%s = [\n", name);
+        for(size_t i = 0; i < arch_count - 1; ++i) {
+            snprintf(buf, sizeof(buf), "ws%zu", i);
+            ws[i].print(buf, 4);
+            snprintf(buf, sizeof(buf), "bs%zu", i);
+            row_print(bs[i], buf, 4);
         }
         printf("]\n");
     }
@@ -397,6 +2548,10 @@ struct NN {
             ws[i].rand(low, high);
             bs[i].rand(low, high);
         }
+        if(cache != nullptr) cache->factors = nullptr;
+        apply_masks();
+        sync_transposed();
+        touch();
     }
 
     auto input() {
@@ -409,24 +2564,26 @@ struct NN {
     }
 
     void forward() {
-        for(size_t i = 0; i < arch_count - 1; ++i) {
-            Mat::dot(as[i + 1].as_mat(), as[i].as_mat(), ws[i]);
-            as[i + 1].as_mat() += as[i].as_mat();
-            as[i + 1].as_mat().act();
-        }
+        for(size_t i = 0; i < arch_count - 1; ++i)
+            forward_layer(as[i + 1].as_mat(), as[i].as_mat(), i);
     }
 
     float cost(Mat t) {
         NN_ASSERT(input().cols + output().cols == t.cols);
-        size_t n = t.rows;
+        return cost(Dataset::split(t, input().cols));
+    }
+
+    float cost(Dataset data) {
+        NN_ASSERT(input().cols == data.x.cols);
+        NN_ASSERT(output().cols == data.y.cols);
+        size_t n = data.size();
 
+        // The input row is bound straight to the samples
+        Row saved = as[0];
         float c = 0;
         for(size_t i = 0; i < n; ++i) {
-            Row row = Mat::row(t, i);
-            Row x = row.slice(0, input().cols);
-            Row y = row.slice(input().cols, output().cols);
-
-            row_copy(input(), x);
+            as[0] = Mat::row(data.x, i);
+            Row y = Mat::row(data.y, i);
             forward();
             size_t q = y.cols;
             for(size_t j = 0; j < q; ++j) {
@@ -434,38 +2591,50 @@ struct NN {
                 c += d * d;
             }
         }
+        as[0] = saved;
 
         return c / n;
     }
 
     NN backprop(Region* r, Mat t) {
-        size_t n = t.rows;
         NN_ASSERT(input().cols + output().cols == t.cols);
+        return backprop(r, Dataset::split(t, input().cols));
+    }
 
-        NN g = NN::alloc(r, {arch, arch_count});
+    NN backprop(Region* r, Dataset data) {
+        size_t n = data.size();
+        NN_ASSERT(input().cols == data.x.cols);
+        NN_ASSERT(output().cols == data.y.cols);
+
+        // With the transposed weights around, the gradient is stored
+        // column-major too so its updates also run down contiguous memory
+        NN g = NN::alloc(r, {arch, arch_count}, Region::GRADIENTS, wts != nullptr ? Mat::COL_MAJOR : NN_WEIGHTS_LAYOUT);
         g.zero();
 
+        // Forward activations and backward deltas of the current sample live
+        // in a planned arena, this->as is left untouched. The input row is
+        // bound straight to the samples, so the plan leaves it no room.
+        const size_t L = arch_count - 1;
+        Row* rows = Mem_Plan::make(r, {arch, arch_count}, Mem_Plan::TRAINING).bind(r);
+        NN f = *this;
+        f.as = rows;
+        Row* ds = rows + L;
+
         // i-current sample
         // l-current layer
         // j-current activation
         // k-previous activation
 
         for(size_t i = 0; i < n; ++i) {
-            Row row = Mat::row(t, i);
-            Row in = row.slice(0, input().cols);
-            Row out = row.slice(input().cols, output().cols);
-
-            row_copy(input(), in);
-            forward();
-
-            for(size_t j = 0; j < arch_count; ++j)
-                g.as[j].fill(0);
+            f.as[0] = Mat::row(data.x, i);
+            Row out = Mat::row(data.y, i);
+            f.forward();
 
             for(size_t j = 0; j < out.cols; ++j) {
 #ifdef NN_BACKPROP_TRADITIONAL
-                g.output()[j] = 2 * (output()[j] - out[j]);
+                ds[L][j] = 2 * (f.output()[j] - out[j]);
 #else
-                g.output()[j] = output()[j] - out[j];
+                ds[L][j] = f.output()[j] - out[j];
 #endif // NN_BACKPROP_TRADITIONAL
             }
 
@@ -475,28 +2644,282 @@ struct NN {
             float s = 2;
 #endif // NN_BACKPROP_TRADITIONAL
 
-            for(size_t l = arch_count - 1; l > 0; --l) {
-                for(size_t j = 0; j < as[l].cols; ++j) {
-                    float a = as[l][j];
-                    float da = g.as[l][j];
+            // A sparse input only has gradients on the weight rows it selects
+            bool sparse = sparse_enough(f.as[0].elements, f.as[0].cols);
+
+            for(size_t l = L; l > 0; --l) {
+                if(l == 1 && sparse) {
+                    for(size_t j = 0; j < f.as[1].cols; ++j) {
+                        ds[1][j] = s * ds[1][j] * NN_ACT.dactf(f.as[1][j]);
+                        g.bs[0][j] += ds[1][j];
+                    }
+                    for_nonzero(f.as[0].elements, f.as[0].cols, [&](size_t k) {
+                        float pa = f.as[0][k];
+                        for(size_t j = 0; j < f.as[1].cols; ++j)
+                            g.ws[0].at(k, j) += ds[1][j] * pa;
+                    });
+                    break;
+                }
+
+                // Nobody needs the cost gradient of the input
+                bool prev = l > 1;
+                if(prev) ds[l - 1].fill(0);
+                for(size_t j = 0; j < f.as[l].cols; ++j) {
+                    float a = f.as[l][j];
+                    float da = ds[l][j];
                     float qa = NN_ACT.dactf(a);
                     g.bs[l - 1][j] += s * da * qa;
-                    for(size_t k = 0; k < as[l - 1].cols; ++k) {
+                    for(size_t k = 0; k < f.as[l - 1].cols; ++k) {
                         // j-weight matrix col
                         // k-weight matrix row
-                        float pa = as[l - 1][k];
-                        float w = ws[l - 1][k][j];
-                        g.ws[l - 1][k][j] += s * da * qa * pa;
-                        g.as[l - 1][k] += s * da * qa * w;
+                        float pa = f.as[l - 1][k];
+                        float w = wts != nullptr ? wts[l - 1].at(j, k) : ws[l - 1].at(k, j);
+                        g.ws[l - 1].at(k, j) += s * da * qa * pa;
+                        if(prev) ds[l - 1][k] += s * da * qa * w;
+                    }
+                }
+            }
+        }
+
+        for(size_t i = 0; i < g.arch_count - 1; ++i) {
+            for(size_t j = 0; j < g.ws[i].rows; ++j)
+                for(size_t k = 0; k < g.ws[i].cols; ++k)
+                    g.ws[i].at(j, k) /= n;
+            for(size_t k = 0; k < g.bs[i].cols; ++k)
+                g.bs[i][k] /= n;
+        }
+
+        return g;
+    }
+
+    // dst = act(src * ws[l] + bs[l]) for every row of src, through the
+    // fastest copy of the weights kept
+    void forward_layer(Mat dst, Mat src, size_t l) {
+        NN_ASSERT(dst.rows == src.rows);
+        const Sparse_Mat* csr = sparse();
+        const Panels* panels = packed();
+        const Mat_Of<NN_HALF>* halves = half();
+        if(cache != nullptr && cache->factors != nullptr && cache->factors[l].rank > 0)
+            dst.assign(act(src * cache->factors[l] + bs[l]));
+        else if(csr != nullptr && csr[l].values != nullptr)
+            dst.assign(act(src * csr[l] + bs[l]));
+        else if(panels != nullptr && (src.rows == 1 ? dot_tiles.pack_single : dot_tiles.pack_batch))
+            dst.assign(act(src * panels[l] + bs[l]));
+        else if(panels != nullptr)
+            dst.assign(act(src * ws[l] + bs[l])); // Unpacked is faster here, see Dot_Tuner
+        else if(halves != nullptr)
+            dst.assign(act(src * halves[l] + bs[l]));
+        else
+            dst.assign(act(src * ws[l] + bs[l]));
+    }
+
+    // dst = the network applied to every row of src, in batches of
+    // NN_FORWARD_ROWS rows through forward_layer() with the activations in
+    // between kept in r. Leaves as alone.
+    void forward_rows(Region* r, Mat dst, Mat src) {
+        const size_t L = arch_count - 1;
+        NN_ASSERT(src.cols == arch[0]);
+        NN_ASSERT(dst.cols == arch[L]);
+        NN_ASSERT(dst.rows == src.rows);
+        Region::Scope scope{r};
+        Region::Tagged tagged{r, Region::ACTIVATIONS};
+        size_t widest = *std::max_element(arch + 1, arch + L + 1);
+        Mat buffers[2] = {
+            Mat::alloc(r, NN_FORWARD_ROWS, widest),
+            Mat::alloc(r, NN_FORWARD_ROWS, widest),
+        };
+        for(size_t i = 0; i < src.rows; i += NN_FORWARD_ROWS) {
+            size_t n = std::min<size_t>(NN_FORWARD_ROWS, src.rows - i);
+            Mat a = src.slice_rows(i, n);
+            for(size_t l = 0; l < L; ++l) {
+                Mat b = l + 1 == L
+                    ? dst.slice_rows(i, n)
+                    : buffers[l % 2].slice_rows(0, n).slice_cols(0, arch[l + 1]);
+                forward_layer(b, a, l);
+                a = b;
+            }
+        }
+    }
+
+    // Bytes of temporary memory backprop_checkpointed() takes for `rows`
+    // samples when only every `stride`-th layer keeps its activations
+    static size_t checkpoint_bytes(std::span<const size_t> arch, size_t rows, size_t stride, bool half = false) {
+        NN_ASSERT(stride > 0);
+        size_t L = arch.size() - 1;
+        size_t widest = *std::ranges::max_element(arch);
+        size_t kept = 0, segment = 0, interior = 0, widest_halved = 0;
+        for(size_t i = 0; i <= L; ++i) {
+            if(i % stride == 0 || i == L) {
+                bool halved = half && i != 0 && i != L;
+                kept += arch[i] * (halved ? sizeof(NN_HALF) : sizeof(float));
+                if(halved) widest_halved = std::max(widest_halved, arch[i]);
+                interior = 0;
+            } else {
+                interior += arch[i];
+                if(segment < interior) segment = interior;
+            }
+        }
+        // Backward needs two delta buffers of the widest layer plus the
+        // recomputed segment and, with half checkpoints, both of its ends
+        // widened back to fp32. That covers the two scratch rows of forward.
+        size_t transient = 2 * widest + segment + 2 * widest_halved;
+        return rows * (kept + sizeof(float) * transient);
+    }
+
+    // The densest checkpointing that fits into `budget_bytes`, or the one
+    // using the least memory if none does
+    static size_t checkpoint_stride(std::span<const size_t> arch, size_t rows, size_t budget_bytes, bool half = false) {
+        size_t L = arch.size() - 1;
+        size_t best = 1;
+        for(size_t stride = 1; stride <= L; ++stride) {
+            size_t bytes = checkpoint_bytes(arch, rows, stride, half);
+            if(bytes <= budget_bytes) return stride;
+            if(bytes < checkpoint_bytes(arch, rows, best, half)) best = stride;
+        }
+        return best;
+    }
+
+    // Batched backprop with gradient checkpointing. The whole batch goes
+    // through every layer at once, but only the activations of every
+    // `stride`-th layer (and the output) are stored. The layers between two
+    // checkpoints are recomputed right before the backward pass needs them.
+    // stride == 1 stores everything. Produces the same gradient as backprop().
+    // With `half` the hidden checkpoints are stored as NN_HALF, which halves
+    // their memory at the price of recomputing from rounded activations.
+    // Two of them are widened back at a time, so it only pays off once the
+    // hidden checkpoints add up to more than four times the widest of them.
+    NN backprop_checkpointed(Region* r, Mat t, size_t stride, bool half = false) {
+        NN_ASSERT(input().cols + output().cols == t.cols);
+        return backprop_checkpointed(r, Dataset::split(t, input().cols), stride, half);
+    }
+
+    NN backprop_checkpointed(Region* r, Dataset data, size_t stride, bool half = false) {
+        size_t n = data.size();
+        NN_ASSERT(input().cols == data.x.cols);
+        NN_ASSERT(output().cols == data.y.cols);
+        NN_ASSERT(stride > 0);
+
+        NN g = NN::alloc(r, {arch, arch_count}, Region::GRADIENTS);
+        g.zero();
+
+        Region::Tagged tagged{r, Region::ACTIVATIONS};
+        const size_t L = arch_count - 1;
+        size_t widest = *std::ranges::max_element(std::span{arch, arch_count});
+        auto checkpoint = [&](size_t i) { return i % stride == 0 || i == L; };
+        auto halved = [&](size_t i) { return half && checkpoint(i) && i != 0 && i != L; };
+
+        // The inputs and targets are read in place
+        Mat* as = (Mat*)Region::alloc(r, sizeof(Mat) * (L + 1));
+        NN_ASSERT(as != nullptr);
+        as[0] = data.x;
+        Mat_Of<NN_HALF>* saved = nullptr;
+        if(half) {
+            saved = (Mat_Of<NN_HALF>*)Region::alloc(r, sizeof(Mat_Of<NN_HALF>) * (L + 1));
+            NN_ASSERT(saved != nullptr);
+        }
+        for(size_t i = 1; i <= L; ++i) {
+            if(halved(i))
+                saved[i] = Mat_Of<NN_HALF>::alloc(r, n, arch[i]);
+            else if(checkpoint(i))
+                as[i] = Mat::alloc(r, n, arch[i]);
+        }
+        Mat ys = data.y;
+
+        {
+            Region::Scope scope{r};
+            float* scratch[2] = {
+                (float*)Region::alloc(r, sizeof(float) * n * widest),
+                (float*)Region::alloc(r, sizeof(float) * n * widest),
+            };
+            Mat prev = as[0];
+            for(size_t i = 1; i <= L; ++i) {
+                Mat cur = checkpoint(i) && !halved(i) ? as[i] : Mat::view(scratch[i % 2], n, arch[i]);
+                forward_layer(cur, prev, i - 1);
+                if(halved(i)) saved[i].load(cur);
+                prev = cur;
+            }
+        }
+
+#ifdef NN_BACKPROP_TRADITIONAL
+        float s = 1;
+        float d = 2;
+#else
+        float s = 2;
+        float d = 1;
+#endif // NN_BACKPROP_TRADITIONAL
+
+        float* deltas[2] = {
+            (float*)Region::alloc(r, sizeof(float) * n * widest),
+            (float*)Region::alloc(r, sizeof(float) * n * widest),
+        };
+        // fp32 copies of the half checkpoints at both ends of a segment
+        float* widened[2] = {};
+        size_t w = 0;
+        size_t widest_halved = 0;
+        for(size_t i = 0; i <= L; ++i)
+            if(halved(i)) widest_halved = std::max(widest_halved, arch[i]);
+        if(widest_halved > 0) {
+            widened[0] = (float*)Region::alloc(r, sizeof(float) * n * widest_halved);
+            widened[1] = (float*)Region::alloc(r, sizeof(float) * n * widest_halved);
+        }
+        Mat ds = Mat::view(deltas[L % 2], n, arch[L]);
+        for(size_t i = 0; i < n; ++i)
+            for(size_t j = 0; j < arch[L]; ++j)
+                ds[i][j] = d * (as[L][i][j] - ys[i][j]);
+
+        for(size_t top = L; top > 0;) {
+            size_t bottom = top - 1;
+            while(!checkpoint(bottom)) bottom -= 1;
+
+            // The top of this segment was widened as the bottom of the last one
+            if(halved(bottom)) {
+                as[bottom] = Mat::view(widened[w], n, arch[bottom]);
+                saved[bottom].store(as[bottom]);
+                w ^= 1;
+            }
+
+            Region::Scope scope{r};
+            for(size_t i = bottom + 1; i < top; ++i) {
+                as[i] = Mat::alloc(r, n, arch[i]);
+                forward_layer(as[i], as[i - 1], i - 1);
+            }
+
+            for(size_t l = top; l > bottom; --l) {
+                // ds becomes the gradient of the pre-activation in place
+                for(size_t i = 0; i < n; ++i)
+                    for(size_t j = 0; j < arch[l]; ++j)
+                        ds[i][j] *= s * NN_ACT.dactf(as[l][i][j]);
+
+                for(size_t i = 0; i < n; ++i) {
+                    for(size_t j = 0; j < arch[l]; ++j)
+                        g.bs[l - 1][j] += ds[i][j];
+                    for(size_t k = 0; k < arch[l - 1]; ++k) {
+                        float pa = as[l - 1][i][k];
+                        if(pa == 0) continue;
+                        for(size_t j = 0; j < arch[l]; ++j)
+                            g.ws[l - 1].at(k, j) += pa * ds[i][j];
                     }
                 }
+
+                if(l == 1) break;
+                Mat pds = Mat::view(deltas[(l - 1) % 2], n, arch[l - 1]);
+                for(size_t i = 0; i < n; ++i) {
+                    for(size_t k = 0; k < arch[l - 1]; ++k) {
+                        float acc = 0;
+                        for(size_t j = 0; j < arch[l]; ++j)
+                            acc += ds[i][j] * ws[l - 1].at(k, j);
+                        pds[i][k] = acc;
+                    }
+                }
+                ds = pds;
             }
+            top = bottom;
         }
 
         for(size_t i = 0; i < g.arch_count - 1; ++i) {
             for(size_t j = 0; j < g.ws[i].rows; ++j)
                 for(size_t k = 0; k < g.ws[i].cols; ++k)
-                    g.ws[i][j][k] /= n;
+                    g.ws[i].at(j, k) /= n;
             for(size_t k = 0; k < g.bs[i].cols; ++k)
                 g.bs[i][k] /= n;
         }
@@ -508,15 +2931,17 @@ struct NN {
         float saved;
         float c = cost(t);
 
-        NN g = NN::alloc(r, {arch, arch_count});
+        NN g = NN::alloc(r, {arch, arch_count}, Region::GRADIENTS);
 
         for(size_t i = 0; i < arch_count - 1; ++i) {
             for(size_t j = 0; j < ws[i].rows; ++j) {
                 for(size_t k = 0; k < ws[i].cols; ++k) {
-                    saved = ws[i][j][k];
-                    ws[i][j][k] += eps;
-                    g.ws[i][j][k] = (cost(t) - c) / eps;
-                    ws[i][j][k] = saved;
+                    saved = ws[i].at(j, k);
+                    ws[i].at(j, k) += eps;
+                    touch();
+                    g.ws[i].at(j, k) = (cost(t) - c) / eps;
+                    ws[i].at(j, k) = saved;
+                    touch();
                 }
             }
 
@@ -531,15 +2956,27 @@ struct NN {
         return g;
     }
 
-    void learn(NN g, float rate) {
+    // Accumulates scale * g into the parameters of this network
+    void add(NN g, float scale) {
         for(size_t i = 0; i < arch_count - 1; ++i) {
-            for(size_t j = 0; j < ws[i].rows; ++j)
-                for(size_t k = 0; k < ws[i].cols; ++k)
-                    ws[i][j][k] -= rate * g.ws[i][j][k];
+            ws[i] += scale * g.ws[i];
+            bs[i] += scale * g.bs[i];
+            add_transposed(i, g.ws[i], scale);
+        }
+        apply_masks();
+        apply_factors(g, scale);
+        touch();
+    }
 
-            for(size_t k = 0; k < bs[i].cols; ++k)
-                bs[i][k] -= rate * g.bs[i][k];
+    void learn(NN g, float rate) {
+        for(size_t i = 0; i < arch_count - 1; ++i) {
+            ws[i] -= rate * g.ws[i];
+            bs[i] -= rate * g.bs[i];
+            add_transposed(i, g.ws[i], -rate);
         }
+        apply_masks();
+        apply_factors(g, -rate);
+        touch();
     }
 };
 
@@ -549,7 +2986,39 @@ struct Batch {
     size_t begin;
     float cost;
     bool finished;
+    // When non-zero, backprop runs batched with gradient checkpointing
+    // and keeps its temporary memory within this many bytes where possible
+    size_t checkpoint_budget;
+    // Checkpoints are then stored as NN_HALF, see NN::backprop_checkpointed()
+    bool half_checkpoints;
+
+    // Gradient accumulation, see accumulate()
+    size_t micro_batches;
+    size_t micro;
+    size_t accum_rows;
+    NN accum;
+
+    // Every process() call then only backprops one micro-batch of
+    // `batch_size` rows and sums its gradient into a persistent buffer
+    // allocated from `r`. The update is applied once per `micro_batches` calls
+    // and at the end of the epoch, so the effective batch size is
+    // batch_size * micro_batches while the temporary memory stays per
+    // micro-batch. Gradients computed elsewhere (e.g. by workers on their own
+    // Region_Pool regions) can be summed into `accum` with NN::add.
+    void accumulate(Region* r, NN nn, size_t micro_batches) {
+        NN_ASSERT(micro_batches > 0);
+        this->micro_batches = micro_batches;
+        micro = 0;
+        accum_rows = 0;
+        accum = NN::alloc(r, {nn.arch, nn.arch_count}, Region::GRADIENTS);
+        accum.zero();
+    }
     void process(Region* r, size_t batch_size, NN nn, Mat t, float rate) {
+        NN_ASSERT(nn.input().cols + nn.output().cols == t.cols);
+        process(r, batch_size, nn, Dataset::split(t, nn.input().cols), rate);
+    }
+
+    void process(Region* r, size_t batch_size, NN nn, Dataset t, float rate) {
         ElapsedTimer et{};
         if(finished) {
             finished = false;
@@ -558,29 +3027,157 @@ struct Batch {
         }
 
         size_t size = batch_size;
-        if(begin + batch_size >= t.rows)
-            size = t.rows - begin;
-
-        // TODO: introduce similar to row_slice operation but for Mat that will give you subsequence of rows
-        Mat batch_t = {
-            .rows = size,
-            .cols = t.cols,
-            .elements = &t[begin][0],
-        };
-
-        NN g = nn.backprop(r, batch_t);
-        nn.learn(g, rate);
+        if(begin + batch_size >= t.size())
+            size = t.size() - begin;
+
+        Dataset batch_t = t.slice_rows(begin, size);
+
+        {
+            // The gradient only lives for this step
+            Region::Scope scope{r};
+            NN g = checkpoint_budget > 0
+                ? nn.backprop_checkpointed(r, batch_t, NN::checkpoint_stride({nn.arch, nn.arch_count}, size, checkpoint_budget, half_checkpoints), half_checkpoints)
+                : nn.backprop(r, batch_t);
+            if(micro_batches > 1) {
+                NN_ASSERT(std::equal(nn.arch, nn.arch + nn.arch_count, accum.arch) && "accumulate() again after NN::shrink()");
+                // backprop averages over the micro-batch, weigh it back by its rows
+                accum.add(g, size);
+                accum_rows += size;
+                micro += 1;
+            } else {
+                nn.learn(g, rate);
+            }
+        }
         cost += nn.cost(batch_t);
         begin += batch_size;
 
-        if(begin >= t.rows) {
-            size_t batch_count = (t.rows + batch_size - 1) / batch_size;
+        if(micro_batches > 1 && (micro == micro_batches || begin >= t.size())) {
+            nn.learn(accum, rate / accum_rows);
+            accum.zero();
+            accum_rows = 0;
+            micro = 0;
+        }
+
+        if(begin >= t.size()) {
+            size_t batch_count = (t.size() + batch_size - 1) / batch_size;
             cost /= batch_count;
             finished = true;
         }
     }
 };
 
+// Prunes nn to `fraction` of its weights in `steps` equal steps, fine-tuning
+// it for `epochs` epochs of t after each one so the remaining weights can
+// make up for the removed ones. The masks live in r, backprop uses temp.
+inline void prune_iterative(Region* r, Region* temp, NN nn, Dataset t, float fraction, size_t steps,
+    size_t epochs, size_t batch_size, float rate, bool global = false) {
+    NN_ASSERT(steps > 0);
+    for(size_t step = 1; step <= steps; ++step) {
+        nn.prune(r, fraction * step / steps, global);
+        Batch batch{};
+        for(size_t epoch = 0; epoch < epochs; ++epoch) {
+            do {
+                batch.process(temp, batch_size, nn, t, rate);
+            } while(!batch.finished);
+        }
+    }
+}
+
+// Largest domain a Truth_Table takes
+#ifndef NN_TRUTH_TABLE_MAX
+#define NN_TRUTH_TABLE_MAX (1 << 20)
+#endif // NN_TRUTH_TABLE_MAX
+
+// The outputs of a network for every input it can get, when each input only
+// takes one of a few values (`levels`). Entry i holds input k at
+// levels[digit k of i in base levels.size()], input 0 being the lowest
+// digit, so with levels {0, 1} the index is just the input bits. Inference is
+// then one indexed load: values row i, or bits[i] with bit j set where
+// output j is above 0.5. update() evaluates the whole domain again with
+// forward_rows(), but only after the weights changed.
+struct Truth_Table {
+    NN nn;
+    std::span<const float> levels;
+    size_t size;
+    Mat values;     // size x outputs
+    uint64_t* bits; // nullptr with more than 64 outputs
+    size_t version; // Of the weights tabulated
+
+    static Truth_Table alloc(Region* r, NN nn, std::span<const float> levels) {
+        NN_ASSERT(nn.cache != nullptr);
+        NN_ASSERT(levels.size() > 1);
+        Truth_Table t;
+        t.nn = nn;
+        t.levels = levels;
+        t.size = 1;
+        for(size_t k = 0; k < nn.arch[0]; ++k) {
+            t.size *= levels.size();
+            NN_ASSERT(t.size <= NN_TRUTH_TABLE_MAX && "The input domain is too large to tabulate");
+        }
+        Region::Tagged tagged{r, Region::ACTIVATIONS};
+        t.values = Mat::alloc(r, t.size, nn.arch[nn.arch_count - 1]);
+        t.bits = nullptr;
+        if(t.values.cols <= 64) {
+            t.bits = (uint64_t*)Region::alloc(r, sizeof(uint64_t) * t.size);
+            NN_ASSERT(t.bits != nullptr);
+        }
+        t.version = nn.cache->version - 1;
+        return t;
+    }
+
+    bool stale() const {
+        return version != nn.cache->version;
+    }
+
+    // Tabulates the network again if its weights changed, in batches of
+    // inputs generated in temp
+    void update(Region* temp) {
+        if(!stale()) return;
+        Region::Scope scope{temp};
+        const size_t batch = NN_FORWARD_ROWS * 16;
+        Mat inputs;
+        {
+            Region::Tagged tagged{temp, Region::SCRATCH};
+            inputs = Mat::alloc(temp, std::min(batch, size), nn.arch[0]);
+        }
+        for(size_t i = 0; i < size; i += batch) {
+            size_t n = std::min(batch, size - i);
+            for(size_t j = 0; j < n; ++j) {
+                size_t index = i + j;
+                for(size_t k = 0; k < inputs.cols; ++k) {
+                    inputs.at(j, k) = levels[index % levels.size()];
+                    index /= levels.size();
+                }
+            }
+            nn.forward_rows(temp, values.slice_rows(i, n), inputs.slice_rows(0, n));
+        }
+        if(bits != nullptr) {
+            for(size_t i = 0; i < size; ++i) {
+                uint64_t b = 0;
+                for(size_t j = 0; j < values.cols; ++j)
+                    b |= (uint64_t)(values.at(i, j) > 0.5f) << j;
+                bits[i] = b;
+            }
+        }
+        version = nn.cache->version;
+    }
+
+    // The entry of an input made of the levels, or of the nearest ones
+    size_t index(Row input) const {
+        NN_ASSERT(input.cols == nn.arch[0]);
+        size_t index = 0;
+        for(size_t k = input.cols; k-- > 0;) {
+            size_t nearest = 0;
+            for(size_t v = 1; v < levels.size(); ++v)
+                if(fabsf(levels[v] - input[k]) < fabsf(levels[nearest] - input[k])) nearest = v;
+            index = index * levels.size() + nearest;
+        }
+        return index;
+    }
+
+    Row row(size_t i) const { return Mat::row(values, i); }
+};
+
 inline float rand_float(void) {
     static std::random_device rd;
     static std::uniform_real_distribution<float> dist{0.f, 1.f};
@@ -0,0 +1,167 @@
+#pragma once
+
+// nn_codegen.hpp compiles a trained NN into a standalone header for fixed
+// deployments.
+//
+// The generated header has the weights as constant arrays and a forward
+// function specialized to the exact arch and NN_ACT, so the compiler sees
+// every bound and weight and can unroll, vectorize and constant-fold it.
+// Layers of up to NN_CODEGEN_UNROLL weights are written out term by term with
+// the zero (pruned) weights left out, larger ones as loops over fixed bounds.
+// It needs nothing but <math.h> and compiles as C99 or C++. Every name starts
+// with the given prefix, so it can sit next to nn.h or nn.hpp. See codegen.cpp
+// for a benchmark against NN::forward().
+
+#include <cctype>
+
+#include "nn.hpp"
+
+#ifndef NN_CODEGEN_UNROLL
+#define NN_CODEGEN_UNROLL 256
+#endif // NN_CODEGEN_UNROLL
+
+struct Codegen {
+    // A literal that reads back as exactly x in C and C++, the macros of
+    // <math.h> for infinities and NaN. They are told apart by the bits, as
+    // -ffast-math lets the compiler fold isnan() and isinf() to false.
+    static void literal(FILE* f, float x) {
+        uint32_t bits = std::bit_cast<uint32_t>(x);
+        if((bits & 0x7F800000) == 0x7F800000) {
+            if((bits & 0x007FFFFF) != 0)
+                fprintf(f, "NAN");
+            else
+                fprintf(f, "%sINFINITY", bits >> 31 ? "-" : "");
+            return;
+        }
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.9g", x);
+        bool fraction = strpbrk(buf, ".en") != nullptr;
+        fprintf(f, "%s%sf", buf, fraction ? "" : ".0");
+    }
+
+    static void activation(FILE* f, const char* name) {
+        fprintf(f, "static inline float %s_act(float x) {\n", name);
+        switch(NN_ACT.type) {
+        case Act::RELU:
+            fprintf(f, "    return x > 0 ? x : x * ");
+            literal(f, NN_RELU_PARAM);
+            fprintf(f, ";\n");
+            break;
+        case Act::SIG:
+            fprintf(f, "    return 1.f / (1.f + expf(-x));\n");
+            break;
+        case Act::SIN:
+            fprintf(f, "    return sinf(x);\n");
+            break;
+        case Act::TANH:
+            fprintf(f, "    return tanhf(x);\n");
+            break;
+        }
+        fprintf(f, "}\n\n");
+    }
+
+    // Writes the header for nn to f. `name` prefixes every identifier in it
+    // and has to be a C identifier itself.
+    static void emit(FILE* f, NN nn, const char* name) {
+        NN_ASSERT(nn.arch_count > 1);
+        const size_t L = nn.arch_count - 1;
+        char guard[128];
+        size_t n = 0;
+        for(; name[n] != '\0' && n + 1 < sizeof(guard); ++n)
+            guard[n] = toupper((unsigned char)name[n]);
+        guard[n] = '\0';
+
+        fprintf(f, "// Generated by nn_codegen.hpp from a network of arch {");
+        for(size_t l = 0; l <= L; ++l)
+            fprintf(f, "%s%zu", l == 0 ? "" : ", ", nn.arch[l]);
+        fprintf(f, "}. Do not edit.\n");
+        fprintf(f, "#ifndef %s_H_\n#define %s_H_\n\n", guard, guard);
+        fprintf(f, "#include <math.h>\n#include <stddef.h>\n\n");
+        fprintf(f, "#ifdef __cplusplus\n#define %s_CONST static constexpr\n", guard);
+        fprintf(f, "#else\n#define %s_CONST static const\n#endif\n\n", guard);
+
+        fprintf(f, "#define %s_ARCH_COUNT %zu\n", guard, nn.arch_count);
+        fprintf(f, "%s_CONST size_t %s_arch[%zu] = {", guard, name, nn.arch_count);
+        for(size_t l = 0; l <= L; ++l)
+            fprintf(f, "%s%zu", l == 0 ? "" : ", ", nn.arch[l]);
+        fprintf(f, "};\n\n");
+
+        // Weights are stored by the neuron they feed: ws[l].at(k, j) is
+        // w<l>[j][k], so every neuron reads one contiguous row
+        for(size_t l = 0; l < L; ++l) {
+            Mat w = nn.ws[l];
+            fprintf(f, "%s_CONST float %s_w%zu[%zu][%zu] = {\n", guard, name, l, w.cols, w.rows);
+            for(size_t j = 0; j < w.cols; ++j) {
+                fprintf(f, "    {");
+                for(size_t k = 0; k < w.rows; ++k) {
+                    if(k > 0) fprintf(f, ", ");
+                    literal(f, w.at(k, j));
+                }
+                fprintf(f, "},\n");
+            }
+            fprintf(f, "};\n");
+            fprintf(f, "%s_CONST float %s_b%zu[%zu] = {", guard, name, l, nn.bs[l].cols);
+            for(size_t j = 0; j < nn.bs[l].cols; ++j) {
+                if(j > 0) fprintf(f, ", ");
+                literal(f, nn.bs[l][j]);
+            }
+            fprintf(f, "};\n\n");
+        }
+
+        // Every layer by index, for code that walks them generically
+        fprintf(f, "static const float* const %s_ws[%zu] = {", name, L);
+        for(size_t l = 0; l < L; ++l)
+            fprintf(f, "%s&%s_w%zu[0][0]", l == 0 ? "" : ", ", name, l);
+        fprintf(f, "};\n");
+        fprintf(f, "static const float* const %s_bs[%zu] = {", name, L);
+        for(size_t l = 0; l < L; ++l)
+            fprintf(f, "%s%s_b%zu", l == 0 ? "" : ", ", name, l);
+        fprintf(f, "};\n\n");
+
+        activation(f, name);
+
+        fprintf(f, "// output[0 .. %zu) = the network applied to input[0 .. %zu)\n", nn.arch[L], nn.arch[0]);
+        fprintf(f, "static inline void %s_forward(const float* input, float* output) {\n", name);
+        for(size_t l = 1; l < L; ++l)
+            fprintf(f, "    float a%zu[%zu];\n", l, nn.arch[l]);
+        for(size_t l = 0; l < L; ++l) {
+            Mat w = nn.ws[l];
+            char src[32], dst[32];
+            if(l == 0)
+                snprintf(src, sizeof(src), "input");
+            else
+                snprintf(src, sizeof(src), "a%zu", l);
+            if(l + 1 == L)
+                snprintf(dst, sizeof(dst), "output");
+            else
+                snprintf(dst, sizeof(dst), "a%zu", l + 1);
+
+            if(w.rows * w.cols <= NN_CODEGEN_UNROLL) {
+                // Same summation order as Mat::dot, then the bias
+                for(size_t j = 0; j < w.cols; ++j) {
+                    fprintf(f, "    %s[%zu] = %s_act(", dst, j, name);
+                    for(size_t k = 0; k < w.rows; ++k) {
+                        if(w.at(k, j) == 0) continue;
+                        fprintf(f, "%s_w%zu[%zu][%zu] * %s[%zu] + ", name, l, j, k, src, k);
+                    }
+                    fprintf(f, "%s_b%zu[%zu]);\n", name, l, j);
+                }
+            } else {
+                fprintf(f, "    for(size_t j = 0; j < %zu; ++j) {\n", w.cols);
+                fprintf(f, "        float s = 0;\n");
+                fprintf(f, "        for(size_t k = 0; k < %zu; ++k)\n", w.rows);
+                fprintf(f, "            s += %s_w%zu[j][k] * %s[k];\n", name, l, src);
+                fprintf(f, "        %s[j] = %s_act(s + %s_b%zu[j]);\n", dst, name, name, l);
+                fprintf(f, "    }\n");
+            }
+        }
+        fprintf(f, "}\n\n#endif // %s_H_\n", guard);
+    }
+
+    static bool save(const char* path, NN nn, const char* name) {
+        FILE* f = fopen(path, "w");
+        if(f == nullptr) return false;
+        emit(f, nn, name);
+        return fclose(f) == 0;
+    }
+};
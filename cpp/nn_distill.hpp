@@ -0,0 +1,105 @@
+#pragma once
+
+// nn_distill.hpp trains a small student NN to imitate a big teacher.
+//
+// The teacher runs once over the training inputs in batched inference and
+// its outputs are cached as soft targets. They carry how sure the teacher
+// is about every output, not just the label, which a student of far fewer
+// neurons learns from more easily than from the original targets. Training
+// the student then never touches the teacher again.
+
+#include "nn.hpp"
+
+struct Distill {
+    // The inputs with the outputs of `teacher` for them as the targets, see
+    // NN::forward_rows(). The returned x is `inputs` itself, y is allocated
+    // from r.
+    static Dataset soft_targets(Region* r, NN teacher, Mat inputs) {
+        NN_ASSERT(inputs.cols == teacher.arch[0]);
+        Dataset soft;
+        soft.x = inputs;
+        {
+            Region::Tagged tagged{r, Region::DATASET};
+            soft.y = Mat::alloc(r, inputs.rows, teacher.arch[teacher.arch_count - 1]);
+        }
+        teacher.forward_rows(r, soft.y, inputs);
+        return soft;
+    }
+
+    // Soft targets for `rows` inputs made up on the fly: generate(Row x)
+    // fills every input
+    template <typename F>
+    static Dataset soft_targets(Region* r, NN teacher, size_t rows, F generate) {
+        Mat inputs;
+        {
+            Region::Tagged tagged{r, Region::DATASET};
+            inputs = Mat::alloc(r, rows, teacher.arch[0]);
+        }
+        for(size_t i = 0; i < rows; ++i)
+            generate(Mat::row(inputs, i));
+        return soft_targets(r, teacher, inputs);
+    }
+
+    // Fits the student to the cached soft targets, backprop uses temp
+    static void train(Region* temp, NN student, Dataset soft, size_t epochs, size_t batch_size, float rate) {
+        NN_ASSERT(student.arch[0] == soft.x.cols);
+        NN_ASSERT(student.arch[student.arch_count - 1] == soft.y.cols);
+        Batch batch{};
+        for(size_t epoch = 0; epoch < epochs; ++epoch) {
+            do {
+                batch.process(temp, batch_size, student, soft, rate);
+            } while(!batch.finished);
+        }
+    }
+};
+
+// How much of the teacher the student keeps over a labelled `test` set, and
+// how much faster its single-sample forward() is
+struct Distill_Report {
+    float teacher_cost;
+    float student_cost;
+    float imitation_cost; // Student against the teacher's outputs
+    size_t teacher_params;
+    size_t student_params;
+    double teacher_seconds; // Per forward()
+    double student_seconds;
+
+    static size_t params(NN nn) {
+        size_t count = 0;
+        for(size_t l = 0; l < nn.arch_count - 1; ++l)
+            count += nn.ws[l].rows * nn.ws[l].cols + nn.bs[l].cols;
+        return count;
+    }
+
+    static double seconds_per_forward(NN nn, Mat inputs) {
+        Row saved = nn.as[0];
+        double seconds = seconds_per_call([&] {
+            for(size_t i = 0; i < inputs.rows; ++i) {
+                nn.as[0] = Mat::row(inputs, i);
+                nn.forward();
+            }
+        });
+        nn.as[0] = saved;
+        return seconds / inputs.rows;
+    }
+
+    static Distill_Report make(Region* r, NN teacher, NN student, Dataset test) {
+        NN_ASSERT(test.size() > 0);
+        Region::Scope scope{r};
+        Distill_Report report{};
+        report.teacher_cost = teacher.cost(test);
+        report.student_cost = student.cost(test);
+        report.imitation_cost = student.cost(Distill::soft_targets(r, teacher, test.x));
+        report.teacher_params = params(teacher);
+        report.student_params = params(student);
+        report.teacher_seconds = seconds_per_forward(teacher, test.x);
+        report.student_seconds = seconds_per_forward(student, test.x);
+        return report;
+    }
+
+    void print() const {
+        printf("distilled: cost %f -> %f (%f off the teacher), params %zu -> %zu, forward %.2f us -> %.2f us (%.2fx)\n",
+            teacher_cost, student_cost, imitation_cost, teacher_params, student_params,
+            teacher_seconds * 1e6, student_seconds * 1e6, teacher_seconds / student_seconds);
+    }
+};
@@ -0,0 +1,194 @@
+#pragma once
+
+// nn_jit.hpp compiles a frozen NN into x86-64 machine code at runtime.
+//
+// Every layer becomes a loop over its neurons whose body is the dot product
+// with the input unrolled to the exact width in SSE, with every offset an
+// immediate. The weights are copied into a blob the code addresses at fixed
+// offsets, each neuron's row padded to 16 bytes. The activation runs over the
+// whole layer through one call per layer. There is nothing left to look up
+// per call, which is most of the cost of forward() for small networks.
+//
+// Code and weights live in their own mmap()ed pages, the code pages are made
+// executable only after they are written. Off x86-64 or without mmap() the
+// network is not compiled and forward() interprets it with NN::forward(). It
+// does the same once the weights change, until compile() is called again.
+// Changes are seen through the version of nn's Cache, so the network needs
+// one and weights written directly have to be followed by touch().
+
+#include "nn.hpp"
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define NN_JIT_X86
+#include <sys/mman.h>
+#endif
+
+struct Jit_NN {
+    using Forward = void (*)(const float* input, float* output);
+
+    NN nn;
+    size_t version; // Of the weights that were compiled
+    Forward fn;     // nullptr when interpreting
+    void* code;
+    size_t code_size;
+    float* data;
+    size_t data_size;
+
+    static void act_layer(float* x, uint32_t n) {
+        for(uint32_t i = 0; i < n; ++i)
+            x[i] = NN_ACT.actf(x[i]);
+    }
+
+    static Jit_NN compile(NN nn) {
+        NN_ASSERT(nn.cache != nullptr && "Only networks with a Cache can tell when the code is stale");
+        Jit_NN jit{};
+        jit.nn = nn;
+        jit.version = nn.cache->version;
+#ifdef NN_JIT_X86
+        jit.emit();
+#endif // NN_JIT_X86
+        return jit;
+    }
+
+    bool compiled() const {
+        return fn != nullptr && nn.cache->version == version;
+    }
+
+    // nn.output() = the network applied to nn.input()
+    void forward() {
+        if(compiled())
+            fn(nn.as[0].elements, nn.output().elements);
+        else
+            nn.forward();
+    }
+
+    void release() {
+#ifdef NN_JIT_X86
+        if(code != nullptr) munmap(code, code_size);
+        if(data != nullptr) munmap(data, data_size);
+#endif // NN_JIT_X86
+        code = nullptr;
+        data = nullptr;
+        fn = nullptr;
+    }
+
+#ifdef NN_JIT_X86
+    static size_t padded(size_t n) { return (n + 3) / 4 * 4; }
+
+    static void* map(size_t size) {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void emit() {
+        const size_t L = nn.arch_count - 1;
+        for(size_t l = 0; l <= L; ++l)
+            if(nn.arch[l] == 0 || nn.arch[l] > UINT32_MAX / 16) return;
+
+        // Weights, then biases, then the hidden activations, all in floats
+        size_t floats = 0;
+        for(size_t l = 0; l < L; ++l)
+            floats += nn.arch[l + 1] * padded(nn.arch[l]) + padded(nn.arch[l + 1]);
+        for(size_t l = 1; l < L; ++l)
+            floats += padded(nn.arch[l]);
+        data_size = floats * sizeof(float);
+        data = (float*)map(data_size);
+        if(data == nullptr) return;
+
+        std::vector<float*> weights(L), biases(L), hidden(L + 1);
+        float* p = data;
+        for(size_t l = 0; l < L; ++l) {
+            size_t row = padded(nn.arch[l]);
+            weights[l] = p;
+            for(size_t j = 0; j < nn.arch[l + 1]; ++j)
+                for(size_t k = 0; k < row; ++k)
+                    p[j * row + k] = k < nn.arch[l] ? nn.ws[l].at(k, j) : 0;
+            p += nn.arch[l + 1] * row;
+            biases[l] = p;
+            for(size_t j = 0; j < nn.arch[l + 1]; ++j)
+                p[j] = nn.bs[l][j];
+            p += padded(nn.arch[l + 1]);
+        }
+        for(size_t l = 1; l < L; ++l) {
+            hidden[l] = p;
+            p += padded(nn.arch[l]);
+        }
+
+        std::vector<uint8_t> c;
+        auto bytes = [&](std::initializer_list<uint8_t> b) { c.insert(c.end(), b); };
+        auto imm32 = [&](uint32_t x) {
+            for(size_t i = 0; i < 4; ++i) c.push_back(x >> (8 * i));
+        };
+        auto imm64 = [&](const void* ptr) {
+            uint64_t x = (uint64_t)ptr;
+            for(size_t i = 0; i < 8; ++i) c.push_back(x >> (8 * i));
+        };
+
+        // rdi = input, rsi = output. r12 walks the layer input, rbx the
+        // weight rows, r13 the outputs and r15 the biases, r14 keeps output.
+        // The five pushes leave the stack 16 byte aligned for the calls.
+        bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57}); // push rbx, r12..r15
+        bytes({0x49, 0x89, 0xFC});                                     // mov r12, rdi
+        bytes({0x49, 0x89, 0xF6});                                     // mov r14, rsi
+        for(size_t l = 0; l < L; ++l) {
+            const size_t in = nn.arch[l], out = nn.arch[l + 1];
+            const uint32_t row = padded(in) * sizeof(float);
+            bytes({0x48, 0xBB}), imm64(weights[l]); // mov rbx, weights
+            bytes({0x49, 0xBF}), imm64(biases[l]);  // mov r15, biases
+            if(l > 0) bytes({0x49, 0xBC}), imm64(hidden[l]); // mov r12, hidden
+            if(l + 1 == L)
+                bytes({0x4D, 0x89, 0xF5}); // mov r13, r14
+            else
+                bytes({0x49, 0xBD}), imm64(hidden[l + 1]); // mov r13, hidden
+            bytes({0xB9}), imm32(out); // mov ecx, out
+
+            size_t loop = c.size();
+            bytes({0x0F, 0x57, 0xC0}); // xorps xmm0, xmm0
+            size_t k = 0;
+            for(; k + 4 <= in; k += 4) {
+                bytes({0x41, 0x0F, 0x10, 0x8C, 0x24}), imm32(k * 4); // movups xmm1, [r12 + 4k]
+                bytes({0x0F, 0x59, 0x8B}), imm32(k * 4);             // mulps xmm1, [rbx + 4k]
+                bytes({0x0F, 0x58, 0xC1});                           // addps xmm0, xmm1
+            }
+            for(; k < in; ++k) {
+                bytes({0xF3, 0x41, 0x0F, 0x10, 0x8C, 0x24}), imm32(k * 4); // movss xmm1, [r12 + 4k]
+                bytes({0xF3, 0x0F, 0x59, 0x8B}), imm32(k * 4);             // mulss xmm1, [rbx + 4k]
+                bytes({0xF3, 0x0F, 0x58, 0xC1});                           // addss xmm0, xmm1
+            }
+            bytes({0x0F, 0x12, 0xC8});             // movhlps xmm1, xmm0
+            bytes({0x0F, 0x58, 0xC1});             // addps xmm0, xmm1
+            bytes({0x0F, 0x28, 0xC8});             // movaps xmm1, xmm0
+            bytes({0x0F, 0xC6, 0xC9, 0x55});       // shufps xmm1, xmm1, 0x55
+            bytes({0xF3, 0x0F, 0x58, 0xC1});       // addss xmm0, xmm1
+            bytes({0xF3, 0x41, 0x0F, 0x58, 0x07}); // addss xmm0, [r15]
+            bytes({0xF3, 0x41, 0x0F, 0x11, 0x45, 0x00}); // movss [r13], xmm0
+            bytes({0x48, 0x81, 0xC3}), imm32(row); // add rbx, row
+            bytes({0x49, 0x83, 0xC5, 0x04});       // add r13, 4
+            bytes({0x49, 0x83, 0xC7, 0x04});       // add r15, 4
+            bytes({0xFF, 0xC9});                   // dec ecx
+            bytes({0x0F, 0x85}), imm32((uint32_t)(loop - (c.size() + 4))); // jnz loop
+
+            if(l + 1 == L)
+                bytes({0x4C, 0x89, 0xF7}); // mov rdi, r14
+            else
+                bytes({0x48, 0xBF}), imm64(hidden[l + 1]); // mov rdi, hidden
+            bytes({0xBE}), imm32(out);                     // mov esi, out
+            bytes({0x48, 0xB8}), imm64((void*)act_layer);  // mov rax, act_layer
+            bytes({0xFF, 0xD0});                           // call rax
+        }
+        bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B}); // pop r15..r12, rbx
+        bytes({0xC3});                                                 // ret
+
+        code_size = c.size();
+        code = map(code_size);
+        if(code == nullptr) return;
+        memcpy(code, c.data(), c.size());
+        if(mprotect(code, code_size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, code_size);
+            code = nullptr;
+            return;
+        }
+        fn = (Forward)code;
+    }
+#endif // NN_JIT_X86
+};
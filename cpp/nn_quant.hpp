@@ -0,0 +1,257 @@
+#pragma once
+
+// nn_quant.hpp freezes a trained NN into an int8 model for inference.
+//
+// The weights into every neuron get their own symmetric scale, so they are
+// stored as int8 in [-127, 127]. The input of every layer is quantized to
+// unsigned 7 bits with a scale and zero point measured by a calibration pass
+// over sample inputs. Products are summed in int32, and the bias and the
+// activation are applied in fp32. Keeping activations to 7 bits means a pair
+// of u8 * s8 products always fits the int16 lanes of pmaddubsw.
+
+#include "nn.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define NN_QUANT_X86
+#include <immintrin.h>
+#endif
+
+// Activation vectors and weight rows are padded with zeros to this many bytes
+#define NN_QUANT_PAD 32
+
+struct Quant_Layer {
+    size_t inputs;
+    size_t outputs;
+    size_t padded;   // inputs rounded up to NN_QUANT_PAD
+    int8_t* ws;      // outputs x padded, row j holds the weights into neuron j
+    float* scales;   // Weight scale of every neuron
+    int32_t* sums;   // Sum of the quantized weights of every neuron
+    float* bs;
+    float in_scale;  // Quantization of the layer input
+    int32_t in_zero;
+
+    uint8_t quantize(float x) const {
+        float q = roundf(x / in_scale) + in_zero;
+        return q < 0 ? 0 : q > 127 ? 127 : (uint8_t)q;
+    }
+};
+
+using Quant_Dot = int32_t (*)(const uint8_t* a, const int8_t* w, size_t n);
+
+inline int32_t quant_dot_scalar(const uint8_t* a, const int8_t* w, size_t n) {
+    int32_t acc = 0;
+    for(size_t k = 0; k < n; ++k)
+        acc += (int32_t)a[k] * (int32_t)w[k];
+    return acc;
+}
+
+#ifdef NN_QUANT_X86
+__attribute__((target("avx2"))) inline int32_t quant_dot_avx2(const uint8_t* a, const int8_t* w, size_t n) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for(size_t k = 0; k < n; k += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + k));
+        __m256i vw = _mm256_loadu_si256((const __m256i*)(w + k));
+        __m256i pairs = _mm256_maddubs_epi16(va, vw);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_hadd_epi32(s, s);
+    s = _mm_hadd_epi32(s, s);
+    return _mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2,avxvnni"))) inline int32_t quant_dot_vnni(const uint8_t* a, const int8_t* w, size_t n) {
+    __m256i acc = _mm256_setzero_si256();
+    for(size_t k = 0; k < n; k += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + k));
+        __m256i vw = _mm256_loadu_si256((const __m256i*)(w + k));
+        acc = _mm256_dpbusd_avx_epi32(acc, va, vw);
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_hadd_epi32(s, s);
+    s = _mm_hadd_epi32(s, s);
+    return _mm_cvtsi128_si32(s);
+}
+#endif // NN_QUANT_X86
+
+// The fastest kernel the CPU supports, picked once
+inline Quant_Dot quant_dot_kernel() {
+    static const Quant_Dot kernel = [] {
+#ifdef NN_QUANT_X86
+        if(__builtin_cpu_supports("avxvnni")) return quant_dot_vnni;
+        if(__builtin_cpu_supports("avx2")) return quant_dot_avx2;
+#endif // NN_QUANT_X86
+        return quant_dot_scalar;
+    }();
+    return kernel;
+}
+
+struct Quant_NN {
+    const size_t* arch;
+    size_t arch_count;
+    Quant_Layer* layers; // arch_count - 1 of them
+    uint8_t** qas;       // Quantized input of every layer
+    Row out;
+
+    // Quantizes nn. Every row of `calibration` is a sample input, the ranges
+    // of the layer inputs are taken from running nn over all of them.
+    static Quant_NN freeze(Region* r, NN nn, Mat calibration) {
+        NN_ASSERT(nn.arch_count > 1);
+        NN_ASSERT(calibration.cols == nn.input().cols);
+        NN_ASSERT(calibration.rows > 0);
+
+        const size_t L = nn.arch_count - 1;
+        Quant_NN q;
+        q.arch_count = nn.arch_count;
+
+        // Ranges always include 0 so that it stays exact. They are only needed
+        // here, so they stay out of r.
+        std::vector<float> lo(L, 0.f), hi(L, 0.f);
+        Row saved = nn.as[0];
+        for(size_t i = 0; i < calibration.rows; ++i) {
+            nn.as[0] = Mat::row(calibration, i);
+            nn.forward();
+            for(size_t l = 0; l < L; ++l)
+                for(size_t k = 0; k < nn.as[l].cols; ++k) {
+                    lo[l] = std::min(lo[l], nn.as[l][k]);
+                    hi[l] = std::max(hi[l], nn.as[l][k]);
+                }
+        }
+        nn.as[0] = saved;
+
+        Region::Tagged tagged{r, Region::WEIGHTS};
+        // A later NN::shrink() rewrites nn.arch
+        size_t* arch = (size_t*)Region::alloc(r, sizeof(size_t) * q.arch_count);
+        NN_ASSERT(arch != nullptr);
+        std::copy_n(nn.arch, q.arch_count, arch);
+        q.arch = arch;
+        q.layers = (Quant_Layer*)Region::alloc(r, sizeof(Quant_Layer) * L);
+        NN_ASSERT(q.layers != nullptr);
+        for(size_t l = 0; l < L; ++l) {
+            Quant_Layer& ql = q.layers[l];
+            Mat w = nn.ws[l];
+            ql.inputs = w.rows;
+            ql.outputs = w.cols;
+            ql.padded = (w.rows + NN_QUANT_PAD - 1) / NN_QUANT_PAD * NN_QUANT_PAD;
+            ql.ws = (int8_t*)Region::alloc(r, ql.outputs * ql.padded);
+            ql.scales = (float*)Region::alloc(r, sizeof(float) * ql.outputs);
+            ql.sums = (int32_t*)Region::alloc(r, sizeof(int32_t) * ql.outputs);
+            ql.bs = (float*)Region::alloc(r, sizeof(float) * ql.outputs);
+            NN_ASSERT(ql.ws != nullptr && ql.scales != nullptr && ql.sums != nullptr && ql.bs != nullptr);
+
+            for(size_t j = 0; j < ql.outputs; ++j) {
+                float m = 0;
+                for(size_t k = 0; k < ql.inputs; ++k)
+                    m = std::max(m, fabsf(w.at(k, j)));
+                float scale = m > 0 ? m / 127 : 1;
+                int8_t* row = ql.ws + j * ql.padded;
+                int32_t sum = 0;
+                for(size_t k = 0; k < ql.padded; ++k) {
+                    row[k] = k < ql.inputs ? (int8_t)roundf(w.at(k, j) / scale) : 0;
+                    sum += row[k];
+                }
+                ql.scales[j] = scale;
+                ql.sums[j] = sum;
+                ql.bs[j] = nn.bs[l][j];
+            }
+
+            ql.in_scale = hi[l] > lo[l] ? (hi[l] - lo[l]) / 127 : 1;
+            ql.in_zero = (int32_t)roundf(-lo[l] / ql.in_scale);
+        }
+
+        Region::Tagged activations{r, Region::ACTIVATIONS};
+        q.qas = (uint8_t**)Region::alloc(r, sizeof(uint8_t*) * L);
+        NN_ASSERT(q.qas != nullptr);
+        for(size_t l = 0; l < L; ++l) {
+            q.qas[l] = (uint8_t*)Region::alloc(r, q.layers[l].padded);
+            NN_ASSERT(q.qas[l] != nullptr);
+            memset(q.qas[l], 0, q.layers[l].padded);
+        }
+        q.out = row_alloc(r, nn.arch[L]);
+
+        return q;
+    }
+
+    size_t weight_bytes() const {
+        size_t bytes = 0;
+        for(size_t l = 0; l < arch_count - 1; ++l)
+            bytes += layers[l].outputs * (layers[l].padded + sizeof(float) * 2 + sizeof(int32_t));
+        return bytes;
+    }
+
+    Row forward(Row input) {
+        NN_ASSERT(input.cols == arch[0]);
+        const Quant_Dot dot = quant_dot_kernel();
+        const size_t L = arch_count - 1;
+        for(size_t k = 0; k < input.cols; ++k)
+            qas[0][k] = layers[0].quantize(input[k]);
+
+        for(size_t l = 0; l < L; ++l) {
+            const Quant_Layer& ql = layers[l];
+            for(size_t j = 0; j < ql.outputs; ++j) {
+                int32_t acc = dot(qas[l], ql.ws + j * ql.padded, ql.padded) - ql.in_zero * ql.sums[j];
+                float y = NN_ACT.actf(ql.in_scale * ql.scales[j] * acc + ql.bs[j]);
+                if(l + 1 < L)
+                    qas[l + 1][j] = layers[l + 1].quantize(y);
+                else
+                    out[j] = y;
+            }
+        }
+        return out;
+    }
+};
+
+// How far the quantized model is from the float one over `inputs`, and how
+// much smaller and faster it is
+struct Quant_Report {
+    float max_error;
+    float mean_error;
+    size_t float_bytes;
+    size_t quant_bytes;
+    double float_seconds; // Per single-sample forward
+    double quant_seconds;
+
+
+    static Quant_Report make(NN nn, Quant_NN q, Mat inputs) {
+        NN_ASSERT(inputs.cols == nn.input().cols);
+        Quant_Report report{};
+        for(size_t l = 0; l < nn.arch_count - 1; ++l)
+            report.float_bytes += (nn.ws[l].rows * nn.ws[l].cols + nn.bs[l].cols) * sizeof(float);
+        report.quant_bytes = q.weight_bytes();
+
+        Row saved = nn.as[0];
+        size_t count = 0;
+        for(size_t i = 0; i < inputs.rows; ++i) {
+            nn.as[0] = Mat::row(inputs, i);
+            nn.forward();
+            Row y = q.forward(nn.as[0]);
+            for(size_t j = 0; j < y.cols; ++j) {
+                float e = fabsf(y[j] - nn.output()[j]);
+                report.max_error = std::max(report.max_error, e);
+                report.mean_error += e;
+                count += 1;
+            }
+        }
+        if(count > 0) report.mean_error /= count;
+
+        report.float_seconds = seconds_per_call([&] {
+            for(size_t i = 0; i < inputs.rows; ++i) {
+                nn.as[0] = Mat::row(inputs, i);
+                nn.forward();
+            }
+        }) / inputs.rows;
+        report.quant_seconds = seconds_per_call([&] {
+            for(size_t i = 0; i < inputs.rows; ++i)
+                q.forward(Mat::row(inputs, i));
+        }) / inputs.rows;
+        nn.as[0] = saved;
+        return report;
+    }
+
+    void print() const {
+        printf("quantized: max error %f, mean error %f, weights %zu -> %zu bytes (%.2fx), forward %.2f us -> %.2f us (%.2fx)\n",
+            max_error, mean_error, float_bytes, quant_bytes, (float)float_bytes / quant_bytes,
+            float_seconds * 1e6, quant_seconds * 1e6, float_seconds / quant_seconds);
+    }
+};
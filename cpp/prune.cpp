@@ -0,0 +1,50 @@
+// Benchmarks the pruned (Sparse_Mat) layer kernels against the dense ones to
+// find the weight density below which sparse wins. NN_SPARSE_WEIGHTS is set
+// from the crossovers it prints for every layer shape.
+#include "nn.hpp"
+
+struct Shape {
+    size_t inputs;
+    size_t outputs;
+    size_t rows; // 1 is the forward() GEMV, more is a batched product
+};
+
+Shape shapes[] = {
+    {784, 14, 1},
+    {784, 256, 1},
+    {1024, 1024, 1},
+    {784, 256, 64},
+};
+
+float densities[] = {0.02f, 0.05f, 0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.7f};
+
+int main(void) {
+    Region r(256 * 1024 * 1024);
+
+    for(Shape shape: shapes) {
+        printf("%zu x %zu, %zu row%s\n", shape.inputs, shape.outputs, shape.rows, shape.rows == 1 ? "" : "s");
+        printf("    density   dense us   sparse us   speedup\n");
+        float crossover = 0;
+        for(float density: densities) {
+            Region::Scope scope{&r};
+            size_t arch[] = {shape.inputs, shape.outputs};
+            NN nn = NN::alloc(&r, arch);
+            nn.rand(-1, 1);
+            nn.prune(&r, 1 - density);
+
+            Mat a = Mat::alloc(&r, shape.rows, shape.inputs);
+            a.rand(0, 1);
+            Mat dst = Mat::alloc(&r, shape.rows, shape.outputs);
+            Sparse_Mat sparse = Sparse_Mat::alloc(&r, nn.ws[0], nn.ws[0]);
+
+            double dense_time = seconds_per_call([&] { Mat::dot(dst, a, nn.ws[0]); });
+            double sparse_time = seconds_per_call([&] { Sparse_Mat::dot(dst, a, sparse); });
+            if(sparse_time < dense_time) crossover = density;
+            printf("    %7.2f   %8.2f   %9.2f   %6.2fx\n",
+                density, dense_time * 1e6, sparse_time * 1e6, dense_time / sparse_time);
+        }
+        printf("    sparse wins up to %.2f density\n\n", crossover);
+    }
+
+    return 0;
+}
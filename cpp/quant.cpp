@@ -0,0 +1,23 @@
+// Freezes a random 784-512-512-10 network into int8 with nn_quant.hpp and
+// compares the frozen model with NN::forward() on error, weight memory and
+// single-sample latency.
+#include "nn_quant.hpp"
+
+size_t arch[] = {784, 512, 512, 10};
+size_t calibration_samples = 256;
+size_t test_samples = 256;
+
+int main(void) {
+    Region r(256 * 1024 * 1024);
+
+    NN nn = NN::alloc(&r, arch);
+    nn.rand(-0.05f, 0.05f);
+    Mat calibration = Mat::alloc(&r, calibration_samples, arch[0]);
+    calibration.rand(0, 1);
+    Mat test = Mat::alloc(&r, test_samples, arch[0]);
+    test.rand(0, 1);
+
+    Quant_NN q = Quant_NN::freeze(&r, nn, calibration);
+    Quant_Report::make(nn, q, test).print();
+    return 0;
+}
@@ -66,11 +66,10 @@ void canvas_to_row(Row row, Olivec_Canvas oc) {
             row[y * oc.width + x] = (float)(OLIVEC_PIXEL(oc, x, y) & 0xFF) / 255.f;
 }
 
-Mat generate_samples(Region* r, size_t samples) {
-    size_t input_size = WIDTH * HEIGHT;
-    size_t output_size = SHAPES;
-    Mat t = Mat::alloc(r, samples * SHAPES, input_size + output_size);
-    size_t s = r->save();
+Dataset generate_samples(Region* r, size_t samples) {
+    Dataset t = Dataset::alloc(r, samples * SHAPES, WIDTH * HEIGHT, SHAPES);
+    Region::Scope scope{r};
+    Region::Tagged tagged{r, Region::SCRATCH};
     Olivec_Canvas oc{};
     oc.pixels = (decltype(oc.pixels))Region::alloc(r, WIDTH * HEIGHT * sizeof(*oc.pixels));
     oc.width = WIDTH;
@@ -81,9 +80,8 @@ Mat generate_samples(Region* r, size_t samples) {
         random_boundary(oc.width, oc.height, &x, &y, &w, &h);
         int r = (w < h ? w : h) / 2;
         for(size_t j = 0; j < SHAPES; ++j) {
-            Row row = Mat::row(t, i * 2 + j);
-            Row in = row.slice(0, input_size);
-            Row out = row.slice(input_size, output_size);
+            Row in = Mat::row(t.x, i * 2 + j);
+            Row out = Mat::row(t.y, i * 2 + j);
             olivec_fill(oc, BACKGROUND_COLOR);
             switch(j) {
             case SHAPE_CIRCLE: olivec_circle(oc, x + w / 2, y + h / 2, r, FOREGROUND_COLOR); break;
@@ -95,7 +93,6 @@ Mat generate_samples(Region* r, size_t samples) {
             out[j] = 1.0f;
         }
     }
-    r->rewind(s);
     return t;
 }
 
@@ -126,11 +123,10 @@ void gym_drawable_canvas(Olivec_Canvas oc, Gym_Rect r) {
                 *(Color*)&OLIVEC_PIXEL(oc, x, y));
 }
 
-void display_training_data(Mat t) {
-    for(size_t i = 0; i < t.rows; ++i) {
-        Row row = Mat::row(t, i);
-        Row in = row.slice(0, WIDTH * HEIGHT);
-        Row out = row.slice(WIDTH * HEIGHT, SHAPES);
+void display_training_data(Dataset t) {
+    for(size_t i = 0; i < t.size(); ++i) {
+        Row in = Mat::row(t.x, i);
+        Row out = Mat::row(t.y, i);
         for(size_t y = 0; y < HEIGHT; ++y) {
             for(size_t x = 0; x < WIDTH; ++x)
                 if(in[y * WIDTH + x] > 1e-6f)
@@ -149,11 +145,19 @@ int main(void) {
     Region temp(256 * 1024 * 1024);
     Region main(256 * 1024 * 1024);
 
+    // Tunes the layer products on the first run on this host, loads the
+    // profile on later ones
+    Dot_Tuner::init(&temp, arch, batch_size);
+
     NN nn = NN::alloc(&main, arch);
     nn.rand(-1, 1);
-    Mat t = generate_samples(&main, TRAINING_SAMPLES_PER_SHAPE);
-    Mat v = generate_samples(&main, VERIFICATION_SAMPLES_PER_SHAPE);
+    nn.keep_transposed(&main);
+    nn.keep_packed(&main);
+    Dataset t = generate_samples(&main, TRAINING_SAMPLES_PER_SHAPE);
+    Dataset v = generate_samples(&main, VERIFICATION_SAMPLES_PER_SHAPE);
 
+    // The histories grow for the whole run, a Region would keep every
+    // outgrown block, so they stay on the heap
     Gym_Plot tplot = {0};
     Gym_Plot vplot = {0};
     Batch batch = {0};
@@ -190,14 +194,13 @@ int main(void) {
             random_rect(canvas);
 
         for(size_t i = 0; i < batches_per_frame && !paused; ++i) {
-            size_t s = temp.save();
+            Region::Scope scope{&temp};
             batch.process(&temp, batch_size, nn, t, rate);
             if(batch.finished) {
                 da_append(&tplot, batch.cost);
                 t.shuffle_rows();
                 da_append(&vplot, nn.cost(v));
             }
-            temp.rewind(s);
         }
 
         BeginDrawing();
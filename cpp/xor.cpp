@@ -66,12 +66,14 @@ int main(void) {
         }
 
         for(size_t i = 0; i < epochs_per_frame && !paused && epoch < max_epoch; ++i) {
+            Region::Scope scope{&temp};
             NN g = nn.backprop(&temp, t);
             nn.learn(g, rate);
             epoch += 1;
             da_append(&plot, nn.cost(t));
         }
 
+        gym_layout_reset(&temp);
         BeginDrawing();
         ClearBackground(GYM_BACKGROUND);
         {
@@ -91,7 +93,7 @@ int main(void) {
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu bytes", epoch, max_epoch, rate, nn.cost(t), temp.occupied_bytes());
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu bytes (peak %zu bytes)", epoch, max_epoch, rate, nn.cost(t), temp.occupied_bytes(), temp.peak_bytes());
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h * 0.04, 0, WHITE);
         }
         EndDrawing();